@@ -0,0 +1,326 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "complexity.h"
+#include "queue.h"
+#include "random.h"
+#include "report.h"
+
+/* Smallest queue size of the sweep, doubled up to the largest one */
+#define CX_MIN_SIZE 256
+
+/* Timings of every operation at every size, the median of which is kept */
+#define CX_RUNS 15
+
+/* Times a cheap operation is repeated within a timing, for the clock to
+ * resolve it
+ */
+#define CX_REPEAT 64
+
+#define CX_MAX_SIZES 20
+
+enum cx_model { CX_1, CX_LOG_N, CX_N, CX_N_LOG_N, CX_N2, CX_MODELS };
+
+static const struct {
+    const char *name;
+    double exponent; /* of n, leaving logarithmic factors aside */
+} models[CX_MODELS] = {
+    [CX_1] = {"O(1)", 0},      [CX_LOG_N] = {"O(log n)", 0},
+    [CX_N] = {"O(n)", 1},      [CX_N_LOG_N] = {"O(n log n)", 1},
+    [CX_N2] = {"O(n^2)", 2},
+};
+
+/* The queues an operation is timed on: a single one, or two to be merged */
+struct cx_input {
+    struct list_head chain;
+    queue_contex_t ctx[2];
+};
+
+static void run_ih(struct cx_input *in)
+{
+    q_insert_head(in->ctx[0].q, "complexity");
+}
+
+static void run_it(struct cx_input *in)
+{
+    q_insert_tail(in->ctx[0].q, "complexity");
+}
+
+static void run_rh(struct cx_input *in)
+{
+    q_release_element(q_remove_head(in->ctx[0].q, NULL, 0));
+}
+
+static void run_rt(struct cx_input *in)
+{
+    q_release_element(q_remove_tail(in->ctx[0].q, NULL, 0));
+}
+
+static void run_size(struct cx_input *in)
+{
+    q_size(in->ctx[0].q);
+}
+
+static void run_dm(struct cx_input *in)
+{
+    q_delete_mid(in->ctx[0].q);
+}
+
+static void run_dedup(struct cx_input *in)
+{
+    q_delete_dup(in->ctx[0].q);
+}
+
+static void run_swap(struct cx_input *in)
+{
+    q_swap(in->ctx[0].q);
+}
+
+static void run_reverse(struct cx_input *in)
+{
+    q_reverse(in->ctx[0].q);
+}
+
+static void run_reverseK(struct cx_input *in)
+{
+    q_reverseK(in->ctx[0].q, 3);
+}
+
+static void run_sort(struct cx_input *in)
+{
+    q_sort(in->ctx[0].q, false);
+}
+
+static void run_ascend(struct cx_input *in)
+{
+    q_ascend(in->ctx[0].q);
+}
+
+static void run_descend(struct cx_input *in)
+{
+    q_descend(in->ctx[0].q);
+}
+
+static void run_merge(struct cx_input *in)
+{
+    q_merge(&in->chain, false);
+}
+
+static void run_shuffle(struct cx_input *in)
+{
+    q_shuffle(in->ctx[0].q);
+}
+
+static void run_free(struct cx_input *in)
+{
+    q_free(in->ctx[0].q);
+    in->ctx[0].q = NULL;
+}
+
+/**
+ * struct cx_op - An operation to time
+ * @name: the qtest command running it
+ * @expected: the complexity it must not clearly exceed
+ * @repeat: times it is run within a timing, 0 for as many as there are
+ *          elements, which amortizes the growth of array-based queues
+ * @sorted: whether it expects sorted queues
+ * @queues: number of queues it works on, the elements being split among them
+ * @run: run it once
+ */
+static const struct cx_op {
+    const char *name;
+    enum cx_model expected;
+    int repeat;
+    bool sorted;
+    int queues;
+    void (*run)(struct cx_input *in);
+} ops[] = {
+    {"ih", CX_1, 0, false, 1, run_ih},
+    {"it", CX_1, 0, false, 1, run_it},
+    {"rh", CX_1, CX_REPEAT, false, 1, run_rh},
+    {"rt", CX_1, CX_REPEAT, false, 1, run_rt},
+    {"size", CX_1, CX_REPEAT, false, 1, run_size},
+    {"dm", CX_N, 1, false, 1, run_dm},
+    {"dedup", CX_N, 1, true, 1, run_dedup},
+    {"swap", CX_N, 1, false, 1, run_swap},
+    {"reverse", CX_N, 1, false, 1, run_reverse},
+    {"reverseK", CX_N, 1, false, 1, run_reverseK},
+    {"sort", CX_N_LOG_N, 1, false, 1, run_sort},
+    {"ascend", CX_N, 1, false, 1, run_ascend},
+    {"descend", CX_N, 1, false, 1, run_descend},
+    {"merge", CX_N_LOG_N, 1, true, 2, run_merge},
+    {"shuffle", CX_N, 1, false, 1, run_shuffle},
+    {"free", CX_N, 1, false, 1, run_free},
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void cx_release(struct cx_input *in)
+{
+    for (int i = 0; i < 2; i++) {
+        q_free(in->ctx[i].q);
+        in->ctx[i].q = NULL;
+    }
+}
+
+/* Fill the queues of the operation with n random strings in all */
+static bool cx_prepare(const struct cx_op *op, struct cx_input *in, int n)
+{
+    INIT_LIST_HEAD(&in->chain);
+    memset(in->ctx, 0, sizeof(in->ctx));
+    for (int i = 0; i < op->queues; i++) {
+        queue_contex_t *ctx = &in->ctx[i];
+        ctx->q = q_new();
+        if (!ctx->q)
+            return false;
+        ctx->id = i;
+        ctx->size = n / op->queues;
+        list_add_tail(&ctx->chain, &in->chain);
+
+        for (int j = 0; j < ctx->size; j++) {
+            char s[9];
+            uint64_t r[8];
+            randombytes((uint8_t *) r, sizeof(r));
+            for (int k = 0; k < 8; k++)
+                s[k] = 'a' + r[k] % 26;
+            s[8] = '\0';
+            if (!q_insert_tail(ctx->q, s))
+                return false;
+        }
+        if (op->sorted)
+            q_sort(ctx->q, false);
+    }
+    return true;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+    double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/* Median time of one run of the operation on n elements, in nanoseconds */
+static bool cx_time(const struct cx_op *op, int n, double *time)
+{
+    double times[CX_RUNS];
+    int repeat = op->repeat ? op->repeat : n;
+    for (int r = 0; r < CX_RUNS; r++) {
+        struct cx_input in;
+        if (!cx_prepare(op, &in, n)) {
+            cx_release(&in);
+            return false;
+        }
+        uint64_t start = now_ns();
+        for (int i = 0; i < repeat; i++)
+            op->run(&in);
+        times[r] = (double) (now_ns() - start) / repeat;
+        cx_release(&in);
+    }
+    qsort(times, CX_RUNS, sizeof(double), cmp_double);
+    /* Below the resolution of the clock, which the logarithms cannot take */
+    *time = times[CX_RUNS / 2] > 1 ? times[CX_RUNS / 2] : 1;
+    return true;
+}
+
+/* Two-sided 95% quantile of Student's t distribution with df degrees of
+ * freedom, rounded up past the table
+ */
+static double t_quantile(int df)
+{
+    static const double table[] = {12.71, 4.30, 3.18, 2.78, 2.57,
+                                   2.45,  2.36, 2.31, 2.26, 2.23};
+    return df <= 10 ? table[df - 1] : 2.2;
+}
+
+static bool cx_fit(const struct cx_op *op, const int *sizes, int k)
+{
+    double x[CX_MAX_SIZES], y[CX_MAX_SIZES];
+    for (int i = 0; i < k; i++) {
+        if (!cx_time(op, sizes[i], &y[i])) {
+            report(1, "ERROR: Could not build queues to time %s on",
+                   op->name);
+            return false;
+        }
+        x[i] = log(sizes[i]);
+    }
+
+    /* Slope of log t against log n, and its standard error */
+    double mx = 0, my = 0;
+    for (int i = 0; i < k; i++) {
+        mx += x[i] / k;
+        my += log(y[i]) / k;
+    }
+    double sxx = 0, sxy = 0;
+    for (int i = 0; i < k; i++) {
+        sxx += (x[i] - mx) * (x[i] - mx);
+        sxy += (x[i] - mx) * (log(y[i]) - my);
+    }
+    double slope = sxy / sxx, rss = 0;
+    for (int i = 0; i < k; i++) {
+        double r = log(y[i]) - my - slope * (x[i] - mx);
+        rss += r * r;
+    }
+    double margin = t_quantile(k - 2) * sqrt(rss / (k - 2) / sxx);
+
+    /* Over the sizes swept, a logarithmic factor adds less to the slope than
+     * caches and the clock do, so only powers of n are told apart. The fit is
+     * the least power the slope does not clearly exceed, by the rule below:
+     * the expected model if it is of that power, the plain power otherwise.
+     */
+    enum cx_model best = CX_1;
+    for (enum cx_model m = CX_1; m < CX_MODELS; m++) {
+        if (models[m].exponent != models[best].exponent)
+            best = m;
+        if (slope - margin <= models[m].exponent + 0.5)
+            break;
+    }
+    if (models[op->expected].exponent == models[best].exponent)
+        best = op->expected;
+
+    report(1,
+           "%-8s best fit %-10s n^%.2f (95%% CI %.2f to %.2f), "
+           "%.0f ns at %d, %.0f ns at %d",
+           op->name, models[best].name, slope, slope - margin,
+           slope + margin, y[0], sizes[0], y[k - 1], sizes[k - 1]);
+
+    /* Tell a growth apart from a logarithmic factor by half a power of n */
+    if (slope - margin > models[op->expected].exponent + 0.5) {
+        report(1, "ERROR: %s grows faster than %s", op->name,
+               models[op->expected].name);
+        return false;
+    }
+    return true;
+}
+
+bool complexity_run(const char *op, int max_size)
+{
+    int sizes[CX_MAX_SIZES], k = 0;
+    for (int n = CX_MIN_SIZE; n <= max_size && k < CX_MAX_SIZES; n *= 2)
+        sizes[k++] = n;
+    if (k < 3) {
+        report(1, "ERROR: Sizes up to at least %d are needed",
+               CX_MIN_SIZE * 4);
+        return false;
+    }
+
+    bool ok = true, found = false;
+    for (size_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++) {
+        if (op && strcmp(op, ops[i].name))
+            continue;
+        found = true;
+        ok &= cx_fit(&ops[i], sizes, k);
+    }
+    if (!found) {
+        report(1, "ERROR: Unknown operation '%s'", op);
+        return false;
+    }
+    return ok;
+}
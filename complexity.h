@@ -0,0 +1,22 @@
+#ifndef LAB0_COMPLEXITY_H
+#define LAB0_COMPLEXITY_H
+
+#include <stdbool.h>
+
+/* Empirical time complexity of the queue operations.
+ *
+ * Every operation is timed on queues whose size doubles from a few hundred
+ * elements up to a given maximum. The slope of log time against log n is
+ * fitted to the timings, along with its 95% confidence interval, which tells
+ * O(1), O(n) and O(n^2) apart. Logarithmic factors are below what the timings
+ * resolve, and only reported as expected.
+ */
+
+/* Time the operation named like its qtest command, or every operation if op
+ * is NULL, on queues of up to max_size elements, and report the fits.
+ * Return false if an operation is unknown, or grows clearly faster than it
+ * should.
+ */
+bool complexity_run(const char *op, int max_size);
+
+#endif /* LAB0_COMPLEXITY_H */
@@ -12,6 +12,7 @@
 #include <unistd.h>
 
 #include "console.h"
+#include "perf.h"
 #include "report.h"
 #include "web.h"
 
@@ -211,7 +212,17 @@ static bool interpret_cmda(int argc, char *argv[])
     while (next_cmd && strcmp(argv[0], next_cmd->name) != 0)
         next_cmd = next_cmd->next;
     if (next_cmd) {
+        /* Count the outermost command only, time runs others */
+        static int depth;
+        perf_sample_t before, after, counts = {0};
+        bool counted = perf_enabled && !depth && perf_read(&before);
+        depth++;
         ok = next_cmd->operation(argc, argv);
+        depth--;
+        if (counted && perf_read(&after)) {
+            perf_add(&counts, &before, &after);
+            perf_report(argv[0], &counts);
+        }
         if (!ok)
             record_error();
     } else {
@@ -402,6 +413,17 @@ static bool do_time(int argc, char *argv[])
     return ok;
 }
 
+/* Open the counters of the console thread as perf is turned on, and keep it
+ * off if they cannot be
+ */
+static void perf_setter(int oldval)
+{
+    if (perf_enabled && !perf_open())
+        perf_enabled = 0;
+    else if (!perf_enabled)
+        perf_close();
+}
+
 static bool use_linenoise = true;
 static int web_fd;
 
@@ -448,6 +470,9 @@ void init_cmd()
     add_param("error", &err_limit, "Number of errors until exit", NULL);
     add_param("echo", &echo, "Do/don't echo commands", NULL);
     add_param("entropy", &show_entropy, "Show/Hide Shannon entropy", NULL);
+    add_param("perf", &perf_enabled,
+              "Count cycles, instructions and misses of every command",
+              perf_setter);
 
     init_in();
     init_time(&last_time);
@@ -0,0 +1,228 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cqueue.h"
+#include "harness.h"
+#include "list_sort.h"
+
+/**
+ * struct cqueue - Queue with separate head and tail locks
+ * @head_lock: taken by removals
+ * @head: list node of the dummy element, whose next is the first element
+ * @tail_lock: taken by insertions
+ * @tail: list node of the last element, or of the dummy if queue is empty
+ * @size: number of elements, updated under either lock
+ *
+ * Padding keeps each lock and the pointer it guards off the cache lines of
+ * the others, the harness not providing aligned allocations. Operations taking
+ * both locks take @head_lock first.
+ */
+struct cqueue {
+    pthread_mutex_t head_lock;
+    struct list_head *head;
+    char pad1[64];
+    pthread_mutex_t tail_lock;
+    struct list_head *tail;
+    char pad2[64];
+    atomic_size_t size;
+};
+
+/* Allocate an element holding a copy of s, with its string stored right
+ * after it when too long to be inline.
+ */
+static element_t *cq_element_new(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    size_t extra = len > Q_INLINE_SIZE ? len : 0;
+    element_t *e = malloc(sizeof(*e) + extra);
+    if (!e)
+        return NULL;
+
+    e->value = extra ? (char *) (e + 1) : e->inline_value;
+    memcpy(e->value, s, len);
+    e->key = element_key(s, len - 1);
+    e->slab = NULL;
+    e->list.next = NULL;
+    e->list.prev = NULL;
+    return e;
+}
+
+static void cq_lock_all(cqueue_t *cq)
+{
+    pthread_mutex_lock(&cq->head_lock);
+    pthread_mutex_lock(&cq->tail_lock);
+}
+
+static void cq_unlock_all(cqueue_t *cq)
+{
+    pthread_mutex_unlock(&cq->tail_lock);
+    pthread_mutex_unlock(&cq->head_lock);
+}
+
+cqueue_t *cq_new(void)
+{
+    cqueue_t *cq = malloc(sizeof(*cq));
+    if (!cq)
+        return NULL;
+
+    element_t *dummy = cq_element_new("");
+    if (!dummy) {
+        free(cq);
+        return NULL;
+    }
+    pthread_mutex_init(&cq->head_lock, NULL);
+    pthread_mutex_init(&cq->tail_lock, NULL);
+    cq->head = cq->tail = &dummy->list;
+    atomic_init(&cq->size, 0);
+    return cq;
+}
+
+void cq_free(cqueue_t *cq)
+{
+    if (!cq)
+        return;
+
+    struct list_head *node = cq->head;
+    while (node) {
+        struct list_head *next = node->next;
+        free(list_entry(node, element_t, list));
+        node = next;
+    }
+    pthread_mutex_destroy(&cq->head_lock);
+    pthread_mutex_destroy(&cq->tail_lock);
+    free(cq);
+}
+
+bool cq_insert_tail(cqueue_t *cq, const char *s)
+{
+    element_t *e = cq_element_new(s);
+    if (!e)
+        return false;
+
+    /* Counted before it can be removed, so that size never drops below 0 */
+    atomic_fetch_add(&cq->size, 1);
+
+    /* A removal may read the link concurrently if queue was empty */
+    pthread_mutex_lock(&cq->tail_lock);
+    __atomic_store_n(&cq->tail->next, &e->list, __ATOMIC_RELEASE);
+    cq->tail = &e->list;
+    pthread_mutex_unlock(&cq->tail_lock);
+    return true;
+}
+
+bool cq_remove_head(cqueue_t *cq, char *sp, size_t bufsize)
+{
+    pthread_mutex_lock(&cq->head_lock);
+    struct list_head *dummy = cq->head;
+    struct list_head *first = __atomic_load_n(&dummy->next, __ATOMIC_ACQUIRE);
+    if (!first) {
+        pthread_mutex_unlock(&cq->head_lock);
+        return false;
+    }
+
+    /* The first element becomes the dummy, its string is no longer part of
+     * the queue.
+     */
+    if (sp) {
+        const char *value = list_entry(first, element_t, list)->value;
+        size_t dlen = strnlen(value, bufsize - 1);
+        memcpy(sp, value, dlen);
+        sp[dlen] = 0;
+    }
+    cq->head = first;
+    atomic_fetch_sub(&cq->size, 1);
+    pthread_mutex_unlock(&cq->head_lock);
+
+    free(list_entry(dummy, element_t, list));
+    return true;
+}
+
+size_t cq_size(cqueue_t *cq)
+{
+    return atomic_load(&cq->size);
+}
+
+void cq_reverse(cqueue_t *cq)
+{
+    cq_lock_all(cq);
+    struct list_head *first = cq->head->next, *prev = NULL;
+    for (struct list_head *node = first, *next; node; node = next) {
+        next = node->next;
+        node->next = prev;
+        prev = node;
+    }
+    if (first) {
+        cq->head->next = prev;
+        cq->tail = first;
+    }
+    cq_unlock_all(cq);
+}
+
+void cq_sort(cqueue_t *cq, bool descend)
+{
+    cq_lock_all(cq);
+    size_t n = atomic_load(&cq->size);
+    if (n < 2) {
+        cq_unlock_all(cq);
+        return;
+    }
+
+    /* Close the chain into a circular list with prev links for list_sort(),
+     * then open it again.
+     */
+    LIST_HEAD(list);
+    struct list_head *prev = &list;
+    for (struct list_head *node = cq->head->next; node; node = node->next) {
+        node->prev = prev;
+        prev = node;
+    }
+    list.next = cq->head->next;
+    list.prev = prev;
+    prev->next = &list;
+
+    list_sort(&list, descend, n);
+
+    cq->head->next = list.next;
+    cq->tail = list.prev;
+    cq->tail->next = NULL;
+    cq_unlock_all(cq);
+}
+
+size_t cq_merge(cqueue_t *to, cqueue_t *from, bool descend)
+{
+    if (to == from)
+        return cq_size(to);
+
+    /* Queues are locked in address order, so that concurrent merges of the
+     * same pair in opposite directions cannot deadlock.
+     */
+    cqueue_t *first = to < from ? to : from;
+    cqueue_t *second = to < from ? from : to;
+    cq_lock_all(first);
+    cq_lock_all(second);
+
+    if (from->head->next) {
+        /* Elements of to come first among equal ones, so that the last
+         * element of from ends up last unless the one of to must follow it.
+         */
+        struct list_head *tail = from->tail;
+        if (to->head->next && !cmp(to->tail, from->tail, descend))
+            tail = to->tail;
+
+        struct list_head *a = to->head->next, *b = from->head->next;
+        to->head->next = a ? merge(descend, a, b) : b;
+        to->tail = tail;
+        atomic_fetch_add(&to->size, atomic_load(&from->size));
+
+        from->head->next = NULL;
+        from->tail = from->head;
+        atomic_store(&from->size, 0);
+    }
+    size_t size = atomic_load(&to->size);
+
+    cq_unlock_all(second);
+    cq_unlock_all(first);
+    return size;
+}
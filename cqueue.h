@@ -0,0 +1,55 @@
+#ifndef LAB0_CQUEUE_H
+#define LAB0_CQUEUE_H
+
+/* Concurrent queue of strings with separate head and tail locks.
+ *
+ * This is the blocking queue of Michael and Scott, see "Simple, Fast, and
+ * Practical Non-Blocking and Blocking Concurrent Queue Algorithms", PODC
+ * 1996. Elements are linked through the next pointer of their list node
+ * behind a dummy element. Insertions only touch the last element under the
+ * tail lock, removals only the dummy and the first element under the head
+ * lock, so that both proceed in parallel. Operations on the whole queue take
+ * both locks.
+ *
+ * The operations mirror the q_* ones of queue.h. Memory comes from the test
+ * harness.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef struct cqueue cqueue_t;
+
+/* Create an empty queue. Return NULL if allocation failed. */
+cqueue_t *cq_new(void);
+
+/* Free the queue along with its elements. No thread may be using it. */
+void cq_free(cqueue_t *cq);
+
+/* Insert a copy of s at tail of queue.
+ * Return false if allocation failed.
+ */
+bool cq_insert_tail(cqueue_t *cq, const char *s);
+
+/* Remove the element at head of queue, copying its string into sp like
+ * q_remove_head() does if sp is not NULL.
+ * Return false if queue is empty.
+ */
+bool cq_remove_head(cqueue_t *cq, char *sp, size_t bufsize);
+
+/* Return the number of elements in queue */
+size_t cq_size(cqueue_t *cq);
+
+/* Reverse the elements of queue */
+void cq_reverse(cqueue_t *cq);
+
+/* Sort the elements of queue in ascending/descending order */
+void cq_sort(cqueue_t *cq, bool descend);
+
+/* Move the elements of the sorted queue from into the sorted queue to,
+ * keeping it sorted in ascending/descending order.
+ * Return the number of elements in to.
+ */
+size_t cq_merge(cqueue_t *to, cqueue_t *from, bool descend);
+
+#endif /* LAB0_CQUEUE_H */
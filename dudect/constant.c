@@ -8,9 +8,21 @@
 #include "random.h"
 
 /* Maintain a queue independent from the qtest since
- * we do not want the test to affect the original functionality
+ * we do not want the test to affect the original functionality.
+ * Every measuring thread has a queue of its own, and a filler queue.
  */
-static struct list_head *l = NULL;
+static __thread struct list_head *l = NULL;
+static __thread struct list_head *filler = NULL;
+
+/* Elements every measurement builds, those the measured queue lacks going to
+ * the filler queue, so that all measurements leave the caches as full
+ */
+#define DUT_ELEMENTS 10001
+
+/* Bytes written over before every measurement, more than the first level
+ * data cache holds
+ */
+#define EVICT_SIZE (64 * 1024)
 
 #define dut_new() ((void) (l = q_new()))
 
@@ -34,10 +46,17 @@ static struct list_head *l = NULL;
             q_insert_tail(l, s); \
     } while (0)
 
-#define dut_free() ((void) (q_free(l)))
+#define dut_free()      \
+    do {                \
+        q_free(l);      \
+        q_free(filler); \
+    } while (0)
+
+int dudect_serialize = 0;
 
-static char random_string[N_MEASURES][8];
-static int random_string_iter = 0;
+static __thread char random_string[N_MEASURES][8];
+static __thread int random_string_iter = 0;
+static __thread uint8_t evict_buffer[EVICT_SIZE];
 
 /* Implement the necessary queue interface to simulation */
 void init_dut(void)
@@ -67,26 +86,71 @@ void prepare_inputs(uint8_t *input_data, uint8_t *classes)
     }
 }
 
+/* Build the queue of a measurement from the size its input picks, plus extra
+ * elements, and the filler queue from the rest of DUT_ELEMENTS, then evict
+ * the first level data cache, so that the caches are in the same state
+ * whatever the size. Operations are then run once untimed, for the lines they
+ * touch to be cached alike. An empty queue takes other stores than any other
+ * one, so operations are measured on queues they never leave empty.
+ */
+static void dut_prepare(const uint8_t *input, int extra)
+{
+    int n = *(uint16_t *) input % 10000 + extra;
+
+    dut_new();
+    dut_insert_head(get_random_string(), n);
+    filler = q_new();
+    for (int j = n; j < DUT_ELEMENTS; j++)
+        q_insert_head(filler, "filler");
+    for (size_t j = 0; j < EVICT_SIZE; j += 64)
+        evict_buffer[j]++;
+}
+
+static inline int64_t tick_begin(void)
+{
+    return dudect_serialize ? cpucycles_begin() : cpucycles();
+}
+
+static inline int64_t tick_end(void)
+{
+    return dudect_serialize ? cpucycles_end() : cpucycles();
+}
+
+int64_t measure_overhead(void)
+{
+    int64_t overhead = INT64_MAX;
+    for (int i = 0; i < 10000; i++) {
+        int64_t before = tick_begin();
+        int64_t delta = tick_end() - before;
+        if (delta < overhead)
+            overhead = delta;
+    }
+    return overhead;
+}
+
 bool measure(int64_t *before_ticks,
              int64_t *after_ticks,
              uint8_t *input_data,
              int mode)
 {
     assert(mode == DUT(insert_head) || mode == DUT(insert_tail) ||
-           mode == DUT(remove_head) || mode == DUT(remove_tail));
+           mode == DUT(remove_head) || mode == DUT(remove_tail) ||
+           mode == DUT(reverse));
 
     switch (mode) {
     case DUT(insert_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
+            dut_prepare(input_data + i * CHUNK_SIZE, 1);
+            dut_insert_head(s, 1);
+            q_release_element(q_remove_head(l, NULL, 0));
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            /* The ticks are stored past the region, out of its timing */
+            int64_t before = tick_begin();
             dut_insert_head(s, 1);
-            after_ticks[i] = cpucycles();
+            int64_t after = tick_end();
+            before_ticks[i] = before;
+            after_ticks[i] = after;
             int after_size = q_size(l);
             dut_free();
             if (before_size != after_size - 1)
@@ -96,14 +160,15 @@ bool measure(int64_t *before_ticks,
     case DUT(insert_tail):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
             char *s = get_random_string();
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
+            dut_prepare(input_data + i * CHUNK_SIZE, 1);
+            dut_insert_tail(s, 1);
+            q_release_element(q_remove_tail(l, NULL, 0));
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            int64_t before = tick_begin();
             dut_insert_tail(s, 1);
-            after_ticks[i] = cpucycles();
+            int64_t after = tick_end();
+            before_ticks[i] = before;
+            after_ticks[i] = after;
             int after_size = q_size(l);
             dut_free();
             if (before_size != after_size - 1)
@@ -112,14 +177,15 @@ bool measure(int64_t *before_ticks,
         break;
     case DUT(remove_head):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
+            dut_prepare(input_data + i * CHUNK_SIZE, 2);
+            q_release_element(q_remove_head(l, NULL, 0));
+            dut_insert_head(get_random_string(), 1);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            int64_t before = tick_begin();
             element_t *e = q_remove_head(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            int64_t after = tick_end();
+            before_ticks[i] = before;
+            after_ticks[i] = after;
             int after_size = q_size(l);
             if (e)
                 q_release_element(e);
@@ -130,14 +196,15 @@ bool measure(int64_t *before_ticks,
         break;
     case DUT(remove_tail):
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000 + 1);
+            dut_prepare(input_data + i * CHUNK_SIZE, 2);
+            q_release_element(q_remove_tail(l, NULL, 0));
+            dut_insert_tail(get_random_string(), 1);
             int before_size = q_size(l);
-            before_ticks[i] = cpucycles();
+            int64_t before = tick_begin();
             element_t *e = q_remove_tail(l, NULL, 0);
-            after_ticks[i] = cpucycles();
+            int64_t after = tick_end();
+            before_ticks[i] = before;
+            after_ticks[i] = after;
             int after_size = q_size(l);
             if (e)
                 q_release_element(e);
@@ -146,15 +213,27 @@ bool measure(int64_t *before_ticks,
                 return false;
         }
         break;
+    case DUT(reverse):
+        for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
+            dut_prepare(input_data + i * CHUNK_SIZE, 1);
+            q_reverse(l);
+            int64_t before = tick_begin();
+            q_reverse(l);
+            int64_t after = tick_end();
+            before_ticks[i] = before;
+            after_ticks[i] = after;
+            dut_free();
+        }
+        break;
     default:
         for (size_t i = DROP_SIZE; i < N_MEASURES - DROP_SIZE; i++) {
-            dut_new();
-            dut_insert_head(
-                get_random_string(),
-                *(uint16_t *) (input_data + i * CHUNK_SIZE) % 10000);
-            before_ticks[i] = cpucycles();
+            dut_prepare(input_data + i * CHUNK_SIZE, 1);
+            dut_size(1);
+            int64_t before = tick_begin();
             dut_size(1);
-            after_ticks[i] = cpucycles();
+            int64_t after = tick_end();
+            before_ticks[i] = before;
+            after_ticks[i] = after;
             dut_free();
         }
     }
@@ -12,11 +12,15 @@
 
 #define DROP_SIZE 20
 
+/* reverse is linear in the size of the queue, for the tests to be checked
+ * against an operation they must find not constant time
+ */
 #define DUT_FUNCS  \
     _(insert_head) \
     _(insert_tail) \
     _(remove_head) \
-    _(remove_tail)
+    _(remove_tail) \
+    _(reverse)
 
 #define DUT(x) DUT_##x
 
@@ -26,6 +30,9 @@ enum {
 #undef _
 };
 
+/* Whether measure() fences its timestamps, see cpucycles_begin() */
+extern int dudect_serialize;
+
 void init_dut();
 void prepare_inputs(uint8_t *input_data, uint8_t *classes);
 bool measure(int64_t *before_ticks,
@@ -33,4 +40,7 @@ bool measure(int64_t *before_ticks,
              uint8_t *input_data,
              int mode);
 
+/* Smallest number of cycles measure() reads around an empty region */
+int64_t measure_overhead(void);
+
 #endif
@@ -26,4 +26,36 @@ static inline int64_t cpucycles(void)
 #endif
 }
 
+/* Variants of cpucycles() to read right before and right after a measured
+ * region, fenced so that no instruction moves into or out of the region:
+ * lfence waits for the ones before it to complete, and rdtscp for the ones
+ * before it to execute.
+ */
+static inline int64_t cpucycles_begin(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("lfence\n\trdtsc\n\t" : "=a"(lo), "=d"(hi)::"memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0" : "=r"(val)::"memory");
+    return val;
+#endif
+}
+
+static inline int64_t cpucycles_end(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    unsigned int hi, lo;
+    __asm__ volatile("rdtscp\n\tlfence\n\t"
+                     : "=a"(lo), "=d"(hi)::"ecx", "memory");
+    return ((int64_t) lo) | (((int64_t) hi) << 32);
+#elif defined(__aarch64__)
+    uint64_t val;
+    asm volatile("isb\n\tmrs %0, cntvct_el0\n\tisb" : "=r"(val)::"memory");
+    return val;
+#endif
+}
+
 #endif
@@ -24,16 +24,30 @@
  *
  *  - as long as any of the different test fails, the code will be deemed
  *    variable time.
+ *
+ *  - the tests are sequential: the statistics are looked at after every
+ *    round of batches, and measuring stops as soon as they are conclusive
+ *    either way. Every look spends part of the false positive rate, so that
+ *    looking often does not turn noise into leaks.
  */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* pthread_setaffinity_np */
+#endif
+
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include "../console.h"
+#include "../perf.h"
 #include "../random.h"
 
 #include "constant.h"
@@ -43,35 +57,87 @@
 #define ENOUGH_MEASURE 10000
 #define TEST_TRIES 10
 
+/* Batches measured before those the tests are fed */
+#define WARMUP_BATCHES 10
+
+/* Measurements a test needs before its t statistic is looked at */
+#define MIN_MEASURE ENOUGH_MEASURE
+
 /* Number of percentiles to calculate */
 #define NUM_PERCENTILES (100)
 #define DUDECT_TESTS (NUM_PERCENTILES + 1)
 
+/* Execution times are counted in a log-linear histogram: values below
+ * 2^HIST_SUB_BITS have a bucket each, and every further power of 2 is split
+ * into 2^HIST_SUB_BITS buckets, so that a bucket is at most 1/32 of its
+ * values wide.
+ */
+#define HIST_SUB_BITS 5
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS) << HIST_SUB_BITS)
+
 static t_context_t *ctxs[DUDECT_TESTS];
 
-/* threshold values for Welch's t-test */
-enum {
-    t_threshold_bananas = 500, /* Test failed with overwhelming probability */
-    t_threshold_moderate = 10, /* Test failed */
-};
+/* Execution times measured by every batch of the current test so far */
+static uint64_t hist[HIST_BUCKETS];
+
+/* Fractions of the execution times kept by each cropping threshold, negative
+ * for thresholds keeping none.
+ */
+static double crop_fractions[NUM_PERCENTILES];
+
+/* Counts of the hardware counters over measure() in the current test */
+static perf_sample_t perf_counts;
+
+/* Cycles the timestamps of an empty region are apart, in the serialized mode */
+static int64_t timer_overhead;
+
+/* Number of times the statistics of the current test were looked at */
+static int looks;
+
+int dudect_threads = 1;
+int dudect_fpr = 1000;
+
+/* The leak a t statistic of 10 over ENOUGH_MEASURE measurements shows */
+int dudect_leak = 100;
+
+/* Measurements of one batch, gathered by one thread into contexts and a
+ * histogram of its own, to be merged into ctxs and hist afterwards.
+ */
+typedef struct {
+    int mode;
+    int cpu; /* The thread is pinned to, or -1 */
+    bool ret;
+    t_context_t ctxs[DUDECT_TESTS];
+    uint64_t hist[HIST_BUCKETS];
+    perf_sample_t perf; /* Counts of measure(), with perf on */
+    pthread_t tid;
+} batch_t;
+
+typedef enum { UNDECIDED, CONSTANT, NOT_CONSTANT } verdict_t;
 
 static void __attribute__((noreturn)) die(void)
 {
     exit(111);
 }
 
-static int64_t percentile(const int64_t *a_sorted, double which, size_t size)
+static inline size_t hist_bucket(int64_t x)
 {
-    assert(which >= 0 && which <= 1.0);
-    size_t pos = (size_t) (which * size);
-    return a_sorted[pos];
+    assert(x > 0);
+    if (x < (1 << HIST_SUB_BITS))
+        return x;
+    int e = 63 - __builtin_clzll(x);
+    size_t sub = (x >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+    return ((size_t) (e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
 }
 
-/* leverages the fact that comparison expressions return 1 or 0. */
-static int cmp(const void *aa, const void *bb)
+/* Smallest value counted in bucket b */
+static inline int64_t hist_value(size_t b)
 {
-    int64_t a = *(const int64_t *) aa, b = *(const int64_t *) bb;
-    return (a > b) - (a < b);
+    if (b < (2 << HIST_SUB_BITS))
+        return b;
+    int e = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    int64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+    return ((1 << HIST_SUB_BITS) + sub) << (e - HIST_SUB_BITS);
 }
 
 /* This function is used to set different thresholds for cropping measurements.
@@ -79,27 +145,49 @@ static int cmp(const void *aa, const void *bb)
  * complementary exponential decay scale as thresholds for cropping
  * measurements: threshold(x) = 1 - 0.5^(10 * x / N_MEASURES), where x is the
  * counter of the measurement.
+ * The percentiles are those of every execution time measured by the test so
+ * far, in hist, together with the ones of the current batch, in batch_hist.
+ * Both histograms are walked once for all thresholds.
  */
-static void prepare_percentiles(int64_t *exec_times, int64_t *percentiles)
+static void prepare_percentiles(const uint64_t *batch_hist,
+                                int64_t *percentiles)
 {
-    qsort(exec_times, N_MEASURES, sizeof(int64_t), cmp);
-
-    for (size_t i = 0; i < NUM_PERCENTILES; i++) {
-        percentiles[i] = percentile(
-            exec_times, 1 - (pow(0.5, 10 * (double) (i + 1) / NUM_PERCENTILES)),
-            N_MEASURES);
+    uint64_t total = 0;
+    for (size_t b = 0; b < HIST_BUCKETS; b++)
+        total += hist[b] + batch_hist[b];
+
+    size_t i = 0;
+    while (i < NUM_PERCENTILES && crop_fractions[i] < 0)
+        percentiles[i++] = 0;
+
+    uint64_t seen = 0;
+    for (size_t b = 0; b < HIST_BUCKETS && i < NUM_PERCENTILES; b++) {
+        seen += hist[b] + batch_hist[b];
+        while (i < NUM_PERCENTILES &&
+               seen > (uint64_t) (crop_fractions[i] * total))
+            percentiles[i++] = hist_value(b);
     }
+    /* Nothing was measured, crop nothing */
+    while (i < NUM_PERCENTILES)
+        percentiles[i++] = INT64_MAX;
 }
 
 static void differentiate(int64_t *exec_times,
                           const int64_t *before_ticks,
                           const int64_t *after_ticks)
 {
-    for (size_t i = 0; i < N_MEASURES; i++)
+    for (size_t i = 0; i < N_MEASURES; i++) {
         exec_times[i] = after_ticks[i] - before_ticks[i];
+        /* Regions shorter than the timer resolution still took some time */
+        if (exec_times[i] > 0 && timer_overhead)
+            exec_times[i] = exec_times[i] > timer_overhead
+                                ? exec_times[i] - timer_overhead
+                                : 1;
+    }
 }
 
-static void update_statistics(const int64_t *exec_times,
+static void update_statistics(t_context_t *batch_ctxs,
+                              const int64_t *exec_times,
                               uint8_t *classes,
                               int64_t *percentiles)
 {
@@ -110,13 +198,13 @@ static void update_statistics(const int64_t *exec_times,
             continue;
 
         /* do a t-test on the execution time */
-        t_push(ctxs[0], difference, classes[i]);
+        t_push(&batch_ctxs[0], difference, classes[i]);
 
         /* t-test on cropped execution times, for several cropping thresholds.
          */
         for (size_t j = 0; j < NUM_PERCENTILES; j++) {
             if (difference < percentiles[j]) {
-                t_push(ctxs[j + 1], difference, classes[i]);
+                t_push(&batch_ctxs[j + 1], difference, classes[i]);
             }
         }
     }
@@ -136,17 +224,37 @@ static t_context_t *max_test()
     return ctxs[max_idx];
 }
 
-static bool report(void)
+/* The z such that a standard normal variable exceeds z with probability p */
+static double normal_quantile(double p)
+{
+    double lo = 0, hi = 40;
+    for (int i = 0; i < 100; i++) {
+        double mid = (lo + hi) / 2;
+        if (0.5 * erfc(mid / M_SQRT2) > p)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Look at the statistics gathered so far, once there are ENOUGH_MEASURE of
+ * them. Within a bound set by the false positive rate, the t statistic tells
+ * how large the leak may be: the test fails once it surely exceeds
+ * dudect_leak, and passes once it surely stays below. The look at the last
+ * measurements compares the leak as measured with dudect_leak.
+ */
+static verdict_t report(bool last)
 {
     t_context_t *t = max_test();
     double number_traces_max_t = t->n[0] + t->n[1];
 
     printf("\033[A\033[2K");
     printf("measure: %7.2lf M, ", (number_traces_max_t / 1e6));
-    if (number_traces_max_t < ENOUGH_MEASURE) {
+    if (number_traces_max_t < MIN_MEASURE && !last) {
         printf("not enough measurements (%.0f still to go).\n",
-               ENOUGH_MEASURE - number_traces_max_t);
-        return false;
+               MIN_MEASURE - number_traces_max_t);
+        return UNDECIDED;
     }
 
     double max_t = fabs(t_compute(t));
@@ -165,40 +273,95 @@ static bool report(void)
     printf("max t: %+7.2f, max tau: %.2e, (5/tau)^2: %.2e.\n", max_t, max_tau,
            (double) (5 * 5) / (double) (max_tau * max_tau));
 
-    /* Definitely not constant time */
-    if (max_t > t_threshold_bananas)
-        return false;
+    double max_tau_allowed = dudect_leak / 1e3;
+    if (last)
+        return max_tau > max_tau_allowed ? NOT_CONSTANT : CONSTANT;
 
-    /* Probably not constant time. */
-    if (max_t > t_threshold_moderate)
-        return false;
+    /* The k-th look spends 6 / (pi^2 k^2) of the false positive rate, which
+     * adds up to the whole of it over any number of looks, and shares it
+     * among the tests and both signs of t.
+     */
+    looks++;
+    double alpha = dudect_fpr / 1e6 * 6 / (M_PI * M_PI * looks * looks);
+    double z = normal_quantile(alpha / (2 * DUDECT_TESTS));
+
+    /* Probably not constant time */
+    if ((max_t - z) / sqrt(number_traces_max_t) > max_tau_allowed)
+        return NOT_CONSTANT;
 
-    /* For the moment, maybe constant time. */
-    return true;
+    /* Probably constant time */
+    if ((max_t + z) / sqrt(number_traces_max_t) < max_tau_allowed)
+        return CONSTANT;
+
+    return UNDECIDED;
 }
 
-static bool doit(int mode)
+static void *measure_batch(void *arg)
 {
+    batch_t *batch = arg;
+    if (batch->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(batch->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
     int64_t *before_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
     int64_t *after_ticks = calloc(N_MEASURES + 1, sizeof(int64_t));
     int64_t *exec_times = calloc(N_MEASURES, sizeof(int64_t));
     uint8_t *classes = calloc(N_MEASURES, sizeof(uint8_t));
     uint8_t *input_data = calloc(N_MEASURES * CHUNK_SIZE, sizeof(uint8_t));
     int64_t *percentiles = calloc(NUM_PERCENTILES, sizeof(int64_t));
+    memset(batch->hist, 0, sizeof(batch->hist));
 
     if (!before_ticks || !after_ticks || !exec_times || !classes ||
         !input_data || !percentiles) {
         die();
     }
 
+    /* Keep page faults out of the measurements. Locking may exceed
+     * RLIMIT_MEMLOCK, and is only worth trying.
+     */
+    struct {
+        void *p;
+        size_t size;
+    } buffers[] = {
+        {before_ticks, (N_MEASURES + 1) * sizeof(int64_t)},
+        {after_ticks, (N_MEASURES + 1) * sizeof(int64_t)},
+        {input_data, N_MEASURES * CHUNK_SIZE},
+    };
+    bool locked[3] = {false};
+    for (size_t i = 0; dudect_serialize && i < 3; i++)
+        locked[i] = !mlock(buffers[i].p, buffers[i].size);
+
+    for (size_t i = 0; i < DUDECT_TESTS; i++)
+        t_init(&batch->ctxs[i]);
     prepare_inputs(input_data, classes);
 
-    bool ret = measure(before_ticks, after_ticks, input_data, mode);
+    /* Batch threads open counters of their own, and close them */
+    bool opened = perf_opened();
+    perf_sample_t before, after;
+    bool counted = perf_enabled && perf_open() && perf_read(&before);
+    batch->ret = measure(before_ticks, after_ticks, input_data, batch->mode);
+    if (counted && perf_read(&after))
+        perf_add(&batch->perf, &before, &after);
+    if (!opened)
+        perf_close();
+
     differentiate(exec_times, before_ticks, after_ticks);
-    prepare_percentiles(exec_times, percentiles);
-    update_statistics(exec_times, classes, percentiles);
-    ret &= report();
+    for (size_t i = 0; i < N_MEASURES; i++) {
+        /* Skip overflowed or dropped measurements */
+        if (exec_times[i] > 0)
+            batch->hist[hist_bucket(exec_times[i])]++;
+    }
+    prepare_percentiles(batch->hist, percentiles);
+
+    update_statistics(batch->ctxs, exec_times, classes, percentiles);
 
+    for (size_t i = 0; i < 3; i++) {
+        if (locked[i])
+            munlock(buffers[i].p, buffers[i].size);
+    }
     free(before_ticks);
     free(after_ticks);
     free(exec_times);
@@ -206,12 +369,71 @@ static bool doit(int mode)
     free(input_data);
     free(percentiles);
 
-    return ret;
+    return NULL;
+}
+
+/* Measure nbatches batches, each on a thread of its own pinned to a CPU when
+ * there are several, merge their statistics in a fixed order, and look at
+ * them, for the last time if last is set.
+ */
+static verdict_t doit(int mode, int nbatches, bool last)
+{
+    batch_t *batches = calloc(nbatches, sizeof(batch_t));
+    if (!batches)
+        die();
+
+    if (nbatches == 1) {
+        batches[0].mode = mode;
+        batches[0].cpu = -1;
+        measure_batch(&batches[0]);
+    } else {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        for (int k = 0; k < nbatches; k++) {
+            batches[k].mode = mode;
+            batches[k].cpu = ncpus > 0 ? k % ncpus : -1;
+            if (pthread_create(&batches[k].tid, NULL, measure_batch,
+                               &batches[k]))
+                die();
+        }
+        for (int k = 0; k < nbatches; k++)
+            pthread_join(batches[k].tid, NULL);
+    }
+
+    bool ret = true;
+    for (int k = 0; k < nbatches; k++) {
+        ret &= batches[k].ret;
+        for (size_t i = 0; i < DUDECT_TESTS; i++)
+            t_merge(ctxs[i], &batches[k].ctxs[i]);
+        for (size_t b = 0; b < HIST_BUCKETS; b++)
+            hist[b] += batches[k].hist[b];
+        perf_sum(&perf_counts, &batches[k].perf);
+    }
+    free(batches);
+
+    /* A queue operation went wrong, time does not matter */
+    if (!ret)
+        return NOT_CONSTANT;
+    return report(last);
 }
 
 static void init_once(void)
 {
     init_dut();
+    memset(hist, 0, sizeof(hist));
+    looks = 0;
+    timer_overhead = 0;
+    memset(&perf_counts, 0, sizeof(perf_counts));
+
+    /* Thresholds used to be percentiles of all N_MEASURES slots of a batch,
+     * the 2 * DROP_SIZE unmeasured ones included as zero times. Keep placing
+     * them the same way among the measured times, so that verdicts stay
+     * comparable.
+     */
+    for (size_t i = 0; i < NUM_PERCENTILES; i++) {
+        double which = 1 - pow(0.5, 10 * (double) (i + 1) / NUM_PERCENTILES);
+        crop_fractions[i] = (which * N_MEASURES - DROP_SIZE * 2) /
+                            (N_MEASURES - DROP_SIZE * 2);
+    }
     for (size_t i = 0; i < DUDECT_TESTS; i++) {
         /* Check if ctxs[i] is unallocated to prevent repeated memory
          * allocations.
@@ -223,28 +445,83 @@ static void init_once(void)
     }
 }
 
+/* First CPU of those the kernel keeps other tasks off, or else the CPU the
+ * calling thread is running on
+ */
+static int isolated_cpu(void)
+{
+    int cpu = -1;
+    FILE *f = fopen("/sys/devices/system/cpu/isolated", "r");
+    if (f) {
+        if (fscanf(f, "%d", &cpu) != 1)
+            cpu = -1;
+        fclose(f);
+    }
+    return cpu >= 0 ? cpu : sched_getcpu();
+}
+
+/* Measure until the sequential test is conclusive, at most as many batches as
+ * TEST_TRIES rounds of ENOUGH_MEASURE measurements take.
+ */
 static bool test_const(char *text, int mode)
 {
-    bool result = false;
+    verdict_t verdict = UNDECIDED;
 
     init_once();
 
-    for (int cnt = 0; cnt < TEST_TRIES; ++cnt) {
-        printf("Testing %s...(%d/%d)\n\n", text, cnt, TEST_TRIES);
-        for (int i = 0; i < ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1;
-             ++i)
-            result = doit(mode);
-        printf("\033[A\033[2K\033[A\033[2K");
-        if (result)
-            break;
+    /* Batches measured by this thread stay on one CPU, with a warm queue
+     * implementation and caches
+     */
+    cpu_set_t saved;
+    bool pinned = false;
+    if (dudect_serialize) {
+        int cpu = isolated_cpu();
+        if (cpu >= 0 && dudect_threads <= 1 &&
+            !pthread_getaffinity_np(pthread_self(), sizeof(saved), &saved)) {
+            cpu_set_t set;
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pinned =
+                !pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        }
+
+        timer_overhead = measure_overhead();
+        printf("Timer overhead: %ld cycles\n", (long) timer_overhead);
+    }
+
+    /* The first batches run on cold caches and a pool still growing, which
+     * the two classes do not see alike: their measurements are dropped.
+     */
+    batch_t *warmup = calloc(1, sizeof(batch_t));
+    if (!warmup)
+        die();
+    for (int i = 0; i < WARMUP_BATCHES; i++) {
+        warmup->mode = mode;
+        warmup->cpu = -1;
+        measure_batch(warmup);
+    }
+    free(warmup);
+
+    int nbatches =
+        TEST_TRIES * (ENOUGH_MEASURE / (N_MEASURES - DROP_SIZE * 2) + 1);
+    int nthreads = dudect_threads > 1 ? dudect_threads : 1;
+    printf("Testing %s...\n\n", text);
+    for (int i = 0; i < nbatches && verdict == UNDECIDED; i += nthreads) {
+        int n = nbatches - i < nthreads ? nbatches - i : nthreads;
+        verdict = doit(mode, n, i + n == nbatches);
     }
+    printf("\033[A\033[2K\033[A\033[2K");
+    if (perf_enabled)
+        perf_report(text, &perf_counts);
+    if (pinned)
+        pthread_setaffinity_np(pthread_self(), sizeof(saved), &saved);
 
     for (size_t i = 0; i < DUDECT_TESTS; i++) {
         free(ctxs[i]);
         ctxs[i] = NULL;
     }
 
-    return result;
+    return verdict == CONSTANT;
 }
 
 #define DUT_FUNC_IMPL(op)                \
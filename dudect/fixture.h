@@ -4,6 +4,15 @@
 #include <stdbool.h>
 #include "constant.h"
 
+/* Number of threads measuring batches in parallel */
+extern int dudect_threads;
+
+/* Rate of constant time functions found not to be, in parts per million */
+extern int dudect_fpr;
+
+/* Largest leak constant time tests let through, as tau in thousandths */
+extern int dudect_leak;
+
 /* Interface to test if function is constant */
 #define _(x) bool is_##x##_const(void);
 DUT_FUNCS
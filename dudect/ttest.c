@@ -47,3 +47,22 @@ void t_init(t_context_t *ctx)
     }
     return;
 }
+
+/* Add the measurements gathered in other to ctx, as if they had been pushed
+ * to ctx. See Chan, Golub and LeVeque, "Updating Formulae and a Pairwise
+ * Algorithm for Computing Sample Variances", 1979.
+ */
+void t_merge(t_context_t *ctx, const t_context_t *other)
+{
+    for (int class = 0; class < 2; class ++) {
+        double n = ctx->n[class] + other->n[class];
+        if (n == 0)
+            continue;
+
+        double delta = other->mean[class] - ctx->mean[class];
+        ctx->mean[class] += delta * other->n[class] / n;
+        ctx->m2[class] += other->m2[class] +
+                          delta * delta * ctx->n[class] * other->n[class] / n;
+        ctx->n[class] = n;
+    }
+}
@@ -1,11 +1,20 @@
 /* Test support code */
 
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* dladdr */
+#endif
+
+#include <dlfcn.h>
+#include <pthread.h>
 #include <setjmp.h>
 #include <signal.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "report.h"
@@ -30,34 +39,103 @@
 
 /* Data structures used by our code */
 
+struct __arena;
+struct __callsite;
+
 /* Represent allocated blocks as doubly-linked list, with
  * next and prev pointers at beginning
  */
 typedef struct __block_element {
     struct __block_element *next, *prev;
+    struct __arena *arena; /* Arena of the thread which allocated the block */
+    struct __callsite *site; /* Allocating call site, in profiling mode */
+    size_t generation;       /* Of the statistics site belongs to */
+    uint64_t born;           /* Time of allocation, in profiling mode */
     size_t payload_size;
     size_t magic_header; /* Marker to see if block seems legitimate */
-    unsigned char payload[0];
+    unsigned char payload[0] __attribute__((aligned(_Alignof(max_align_t))));
     /* Also place magic number at tail of every block */
 } block_element_t;
 
-static block_element_t *allocated = NULL;
-static size_t allocated_count = 0;
+/* Every allocated block is also recorded in an open-addressing hash set keyed
+ * by its address, so that cautious mode can validate a pointer in O(1)
+ * instead of scanning the whole list. Collisions are resolved by linear
+ * probing; deletion shifts entries back, so no tombstones are needed.
+ */
+#define BLOCK_TABLE_MIN 1024
+
+/* Allocation state of a thread. Each thread allocates from an arena of its
+ * own, so that threads do not contend on a global lock. The lock of an arena
+ * is only contended when another thread frees one of its blocks.
+ * Arenas outlive their threads, whose blocks may still be in use, and are
+ * handed over to threads started later.
+ */
+typedef struct __arena {
+    pthread_mutex_t lock;
+    block_element_t *allocated;
+    size_t allocated_count;
+    block_element_t **block_table;
+    size_t block_table_size; /* Always zero or a power of 2 */
+    bool in_use;
+    struct __arena *next;
+} arena_t;
+
+/* Every arena ever created, guarded by arenas_lock for insertions */
+static arena_t *_Atomic arenas = NULL;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t arena_key;
+static pthread_once_t arena_key_once = PTHREAD_ONCE_INIT;
+static __thread arena_t *arena = NULL;
+
+/* Number of log2 size classes allocations are counted in */
+#define SIZE_CLASSES 32
+
+/* Call sites the profiler tells apart, a power of 2 */
+#define PROFILE_SITES 1024
+
+/* Statistics of the blocks allocated by a call site of the harness */
+typedef struct __callsite {
+    void *caller; /* Return address of the allocation function */
+    const char *fn;
+    size_t count, bytes;
+    size_t live_bytes, peak_bytes;
+    size_t freed;
+    uint64_t lifetime; /* Total of the freed blocks, in nanoseconds */
+    size_t classes[SIZE_CLASSES];
+} callsite_t;
+
+/* Open-addressing table of call sites keyed by caller, guarded by
+ * profile_lock. Blocks allocated before the last reset belong to an older
+ * generation, and are no longer accounted for when freed.
+ */
+static callsite_t callsites[PROFILE_SITES];
+static size_t ncallsites = 0;
+static size_t profile_generation = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /* Percent probability of malloc failure */
 int fail_probability = 0;
 
+/* Nonzero to profile allocations by call site */
+int alloc_profile = 0;
+
+/* Nonzero to skip the bookkeeping of blocks, see harness.h */
+int fast_mode = 0;
+
+/* Blocks allocated in fast mode, which belong to no arena */
+static atomic_size_t fast_count = 0;
+
 static bool cautious_mode = true;
 static bool noallocate_mode = false;
-static bool error_occurred = false;
-static char *error_message = "";
+static atomic_bool error_occurred = false;
 
 static int time_limit = 1;
 
-/* Data for managing exceptions */
-static jmp_buf env;
-static volatile sig_atomic_t jmp_ready = false;
-static bool time_limited = false;
+/* Data for managing exceptions, of which each thread has its own */
+static __thread jmp_buf env;
+static __thread volatile sig_atomic_t jmp_ready = false;
+static __thread bool time_limited = false;
+static __thread char *error_message = "";
 
 /* For test_malloc and test_calloc */
 typedef enum {
@@ -67,6 +145,83 @@ typedef enum {
 
 /* Internal functions */
 
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Size class of a block of size bytes: class k holds sizes in
+ * (2^(k-1), 2^k], class 0 size 0 and 1.
+ */
+static inline int size_class(size_t size)
+{
+    int k = size > 1 ? 64 - __builtin_clzll(size - 1) : 0;
+    return k < SIZE_CLASSES ? k : SIZE_CLASSES - 1;
+}
+
+/* Return the statistics of the allocations by fn returning to caller, or NULL
+ * once the table is full. Called with profile_lock held.
+ */
+static callsite_t *callsite_find(void *caller, const char *fn)
+{
+    uint64_t h = (uint64_t) (uintptr_t) caller * 0x9e3779b97f4a7c15ULL;
+    size_t i = (h >> 32) & (PROFILE_SITES - 1);
+    for (; callsites[i].caller; i = (i + 1) & (PROFILE_SITES - 1)) {
+        if (callsites[i].caller == caller && !strcmp(callsites[i].fn, fn))
+            return &callsites[i];
+    }
+    /* Keep a free slot, so that lookups terminate */
+    if (ncallsites == PROFILE_SITES - 1)
+        return NULL;
+
+    ncallsites++;
+    callsites[i].caller = caller;
+    callsites[i].fn = fn;
+    return &callsites[i];
+}
+
+/* Account for block b of size bytes allocated by fn, returning to caller */
+static void profile_alloc(block_element_t *b,
+                          size_t size,
+                          void *caller,
+                          const char *fn)
+{
+    b->site = NULL;
+    if (!alloc_profile)
+        return;
+
+    pthread_mutex_lock(&profile_lock);
+    callsite_t *site = callsite_find(caller, fn);
+    if (site) {
+        site->count++;
+        site->bytes += size;
+        site->live_bytes += size;
+        if (site->live_bytes > site->peak_bytes)
+            site->peak_bytes = site->live_bytes;
+        site->classes[size_class(size)]++;
+        b->site = site;
+        b->generation = profile_generation;
+        b->born = now_ns();
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+static void profile_free(block_element_t *b)
+{
+    if (!b->site)
+        return;
+
+    pthread_mutex_lock(&profile_lock);
+    if (b->generation == profile_generation) {
+        b->site->live_bytes -= b->payload_size;
+        b->site->freed++;
+        b->site->lifetime += now_ns() - b->born;
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
 /* Should this allocation fail? */
 static bool fail_allocation()
 {
@@ -74,10 +229,162 @@ static bool fail_allocation()
     return (weight < 0.01 * fail_probability);
 }
 
-/* Find header of block, given its payload.
- * Signal error if doesn't seem like legitimate block
+static inline size_t block_hash(const arena_t *a, const block_element_t *b)
+{
+    /* Fibonacci hashing; the low bits of addresses are mostly zero */
+    uint64_t h = (uint64_t) (uintptr_t) b * 0x9e3779b97f4a7c15ULL;
+    return (size_t) (h >> 32) & (a->block_table_size - 1);
+}
+
+static void block_table_put(arena_t *a, block_element_t *b)
+{
+    size_t i = block_hash(a, b);
+    while (a->block_table[i])
+        i = (i + 1) & (a->block_table_size - 1);
+    a->block_table[i] = b;
+}
+
+/* Keep the load factor of the table at most 1/2.
+ * Return false if no larger table could be allocated.
  */
-static block_element_t *find_header(void *p)
+static bool block_table_grow(arena_t *a)
+{
+    size_t old_size = a->block_table_size;
+    size_t new_size = old_size ? old_size << 1 : BLOCK_TABLE_MIN;
+    block_element_t **old_table = a->block_table;
+    block_element_t **new_table = calloc(new_size, sizeof(block_element_t *));
+    if (!new_table) {
+        report_event(MSG_FATAL, "Couldn't allocate any more memory");
+        error_occurred = true;
+        return false;
+    }
+
+    a->block_table = new_table;
+    a->block_table_size = new_size;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old_table[i])
+            block_table_put(a, old_table[i]);
+    }
+    free(old_table);
+    return true;
+}
+
+/* Return false if the table is full and could not grow */
+static bool block_table_insert(arena_t *a, block_element_t *b)
+{
+    if ((a->allocated_count + 1) * 2 > a->block_table_size &&
+        !block_table_grow(a) && a->allocated_count >= a->block_table_size)
+        return false;
+    block_table_put(a, b);
+    return true;
+}
+
+static bool block_table_contains(const arena_t *a, const block_element_t *b)
+{
+    if (!a->block_table_size)
+        return false;
+
+    for (size_t i = block_hash(a, b); a->block_table[i];
+         i = (i + 1) & (a->block_table_size - 1)) {
+        if (a->block_table[i] == b)
+            return true;
+    }
+    return false;
+}
+
+static void block_table_remove(arena_t *a, const block_element_t *b)
+{
+    if (!a->block_table_size)
+        return;
+
+    block_element_t **block_table = a->block_table;
+    size_t mask = a->block_table_size - 1;
+    size_t i = block_hash(a, b);
+    while (block_table[i] != b) {
+        /* Not a block we handed out; only possible without cautious mode */
+        if (!block_table[i])
+            return;
+        i = (i + 1) & mask;
+    }
+
+    /* Shift back later entries of the probe sequence that would otherwise
+     * become unreachable through the hole at i.
+     */
+    for (size_t j = (i + 1) & mask; block_table[j]; j = (j + 1) & mask) {
+        size_t home = block_hash(a, block_table[j]);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            block_table[i] = block_table[j];
+            i = j;
+        }
+    }
+    block_table[i] = NULL;
+}
+
+/* Release an arena when its thread exits, for another thread to claim */
+static void arena_release(void *a)
+{
+    pthread_mutex_lock(&arenas_lock);
+    ((arena_t *) a)->in_use = false;
+    pthread_mutex_unlock(&arenas_lock);
+}
+
+static void arena_key_create()
+{
+    pthread_key_create(&arena_key, arena_release);
+}
+
+/* Return the arena of the calling thread, claiming one on first use.
+ * Return NULL if no arena could be allocated.
+ */
+static arena_t *current_arena()
+{
+    if (arena)
+        return arena;
+
+    pthread_once(&arena_key_once, arena_key_create);
+    pthread_mutex_lock(&arenas_lock);
+    arena_t *a = arenas;
+    while (a && a->in_use)
+        a = a->next;
+    if (!a) {
+        a = calloc(1, sizeof(arena_t));
+        if (a) {
+            pthread_mutex_init(&a->lock, NULL);
+            a->next = arenas;
+            arenas = a;
+        }
+    }
+    if (a)
+        a->in_use = true;
+    pthread_mutex_unlock(&arenas_lock);
+
+    if (a) {
+        pthread_setspecific(arena_key, a);
+        arena = a;
+    }
+    return a;
+}
+
+/* Find the arena which recorded block b, and return it locked.
+ * Return NULL if no arena has it.
+ */
+static arena_t *find_arena(const block_element_t *b)
+{
+    for (arena_t *a = arenas; a; a = a->next) {
+        pthread_mutex_lock(&a->lock);
+        if (block_table_contains(a, b))
+            return a;
+        pthread_mutex_unlock(&a->lock);
+    }
+    return NULL;
+}
+
+/* Find header of block, given its payload, and lock the arena it belongs to
+ * into *owner, which remains NULL for blocks allocated in fast mode.
+ * Signal error if doesn't seem like legitimate block. Return NULL if the block
+ * was found not to be allocated.
+ */
+static block_element_t *find_header(void *p, arena_t **owner)
 {
     if (!p) {
         report_event(MSG_ERROR, "Attempting to free null block");
@@ -86,19 +393,18 @@ static block_element_t *find_header(void *p)
 
     block_element_t *b =
         (block_element_t *) ((size_t) p - sizeof(block_element_t));
-    if (cautious_mode) {
-        /* Make sure this is really an allocated block */
-        block_element_t *ab = allocated;
-        bool found = false;
-        while (ab && !found) {
-            found = ab == b;
-            ab = ab->next;
-        }
-        if (!found) {
+    *owner = NULL;
+    if (cautious_mode && !fast_mode) {
+        /* Make sure this is really an allocated block. Blocks allocated in
+         * fast mode are in no arena, their header has to do.
+         */
+        *owner = find_arena(b);
+        if (!*owner && (b->magic_header != MAGICHEADER || b->arena)) {
             report_event(MSG_ERROR,
                          "Attempted to free unallocated block.  Address = %p",
                          p);
             error_occurred = true;
+            return NULL;
         }
     }
 
@@ -110,6 +416,10 @@ static block_element_t *find_header(void *p)
         error_occurred = true;
     }
 
+    if (!*owner && b->arena) {
+        *owner = b->arena;
+        pthread_mutex_lock(&(*owner)->lock);
+    }
     return b;
 }
 
@@ -122,7 +432,10 @@ static size_t *find_footer(block_element_t *b)
     return p;
 }
 
-static void *alloc(alloc_t alloc_type, size_t size)
+static void *alloc(alloc_t alloc_type,
+                   size_t size,
+                   void *caller,
+                   const char *fn)
 {
     if (noallocate_mode) {
         char *msg_alloc_forbidden[] = {
@@ -133,7 +446,7 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
-    if (fail_allocation()) {
+    if (fail_probability && fail_allocation()) {
         char *msg_alloc_failure[] = {
             "Malloc returning NULL",
             "Calloc returning NULL",
@@ -142,8 +455,28 @@ static void *alloc(alloc_t alloc_type, size_t size)
         return NULL;
     }
 
+    if (fast_mode) {
+        block_element_t *b =
+            malloc(size + sizeof(block_element_t) + sizeof(size_t));
+        if (!b) {
+            report_event(MSG_FATAL, "Couldn't allocate any more memory");
+            error_occurred = true;
+            return NULL;
+        }
+        b->arena = NULL;
+        b->site = NULL;
+        b->magic_header = MAGICHEADER;
+        b->payload_size = size;
+        *find_footer(b) = MAGICFOOTER;
+        if (alloc_type == TEST_CALLOC)
+            memset(&b->payload, 0, size);
+        atomic_fetch_add_explicit(&fast_count, 1, memory_order_relaxed);
+        return &b->payload;
+    }
+
+    arena_t *a = current_arena();
     block_element_t *new_block =
-        malloc(size + sizeof(block_element_t) + sizeof(size_t));
+        a ? malloc(size + sizeof(block_element_t) + sizeof(size_t)) : NULL;
     if (!new_block) {
         report_event(MSG_FATAL, "Couldn't allocate any more memory");
         error_occurred = true;
@@ -157,14 +490,23 @@ static void *alloc(alloc_t alloc_type, size_t size)
     void *p = (void *) &new_block->payload;
     memset(p, !alloc_type * FILLCHAR, size);
     // cppcheck-suppress nullPointerRedundantCheck
-    new_block->next = allocated;
+    new_block->arena = a;
     // cppcheck-suppress nullPointerRedundantCheck
     new_block->prev = NULL;
 
-    if (allocated)
-        allocated->prev = new_block;
-    allocated = new_block;
-    allocated_count++;
+    pthread_mutex_lock(&a->lock);
+    if (!block_table_insert(a, new_block)) {
+        pthread_mutex_unlock(&a->lock);
+        free(new_block);
+        return NULL;
+    }
+    new_block->next = a->allocated;
+    if (a->allocated)
+        a->allocated->prev = new_block;
+    a->allocated = new_block;
+    a->allocated_count++;
+    pthread_mutex_unlock(&a->lock);
+    profile_alloc(new_block, size, caller, fn);
 
     return p;
 }
@@ -173,7 +515,12 @@ static void *alloc(alloc_t alloc_type, size_t size)
 
 void *test_malloc(size_t size)
 {
-    return alloc(TEST_MALLOC, size);
+    return alloc(TEST_MALLOC, size, __builtin_return_address(0), "malloc");
+}
+
+void *test_malloc_at(size_t size, void *caller, const char *fn)
+{
+    return alloc(TEST_MALLOC, size, caller, fn);
 }
 
 // cppcheck-suppress unusedFunction
@@ -184,7 +531,8 @@ void *test_calloc(size_t nelem, size_t elsize)
      */
     if (!nelem || !elsize || nelem > SIZE_MAX / elsize)
         return NULL;
-    return alloc(TEST_CALLOC, nelem * elsize);
+    return alloc(TEST_CALLOC, nelem * elsize, __builtin_return_address(0),
+                 "calloc");
 }
 
 void test_free(void *p)
@@ -197,7 +545,10 @@ void test_free(void *p)
     if (!p)
         return;
 
-    block_element_t *b = find_header(p);
+    arena_t *a = NULL;
+    block_element_t *b = find_header(p, &a);
+    if (!b)
+        return;
     size_t footer = *find_footer(b);
     if (footer != MAGICFOOTER) {
         report_event(MSG_ERROR,
@@ -208,7 +559,13 @@ void test_free(void *p)
     }
     b->magic_header = MAGICFREE;
     *find_footer(b) = MAGICFREE;
+    if (!a) {
+        atomic_fetch_sub_explicit(&fast_count, 1, memory_order_relaxed);
+        free(b);
+        return;
+    }
     memset(p, FILLCHAR, b->payload_size);
+    profile_free(b);
 
     /* Unlink from list */
     block_element_t *bn = b->next;
@@ -216,28 +573,130 @@ void test_free(void *p)
     if (bp)
         bp->next = bn;
     else
-        allocated = bn;
+        a->allocated = bn;
     if (bn)
         bn->prev = bp;
+    block_table_remove(a, b);
+    a->allocated_count--;
+    pthread_mutex_unlock(&a->lock);
 
     free(b);
-    allocated_count--;
 }
 
 // cppcheck-suppress unusedFunction
 char *test_strdup(const char *s)
 {
     size_t len = strlen(s) + 1;
-    void *new = test_malloc(len);
+    void *new = alloc(TEST_MALLOC, len, __builtin_return_address(0), "strdup");
     if (!new)
         return NULL;
 
     return memcpy(new, s, len);
 }
 
+/* Sum the blocks still allocated in every arena and in fast mode */
 size_t allocation_check()
 {
-    return allocated_count;
+    size_t count = atomic_load(&fast_count);
+    for (arena_t *a = arenas; a; a = a->next) {
+        pthread_mutex_lock(&a->lock);
+        count += a->allocated_count;
+        pthread_mutex_unlock(&a->lock);
+    }
+    return count;
+}
+
+/* Name the function caller returns into as symbol+offset. Only symbols
+ * exported to the dynamic symbol table are known, static functions are named
+ * as file+offset instead, for addr2line to resolve.
+ */
+static void callsite_name(void *caller, char *buf, size_t size)
+{
+    Dl_info info;
+    /* Look up the call instruction, in case the caller is a noreturn tail */
+    if (!dladdr((char *) caller - 1, &info)) {
+        snprintf(buf, size, "%p", caller);
+    } else if (info.dli_sname) {
+        snprintf(buf, size, "%s+0x%tx", info.dli_sname,
+                 (char *) caller - (char *) info.dli_saddr);
+    } else {
+        const char *file = strrchr(info.dli_fname, '/');
+        snprintf(buf, size, "%s+0x%tx", file ? file + 1 : info.dli_fname,
+                 (char *) caller - (char *) info.dli_fbase);
+    }
+}
+
+static size_t callsite_key(const callsite_t *c, alloc_order_t order)
+{
+    switch (order) {
+    case ALLOC_BY_BYTES:
+        return c->bytes;
+    case ALLOC_BY_PEAK:
+        return c->peak_bytes;
+    default:
+        return c->count;
+    }
+}
+
+/* For qsort, which has no context argument. Guarded by profile_lock. */
+static alloc_order_t profile_order;
+
+static int callsite_cmp(const void *a, const void *b)
+{
+    size_t ka = callsite_key(*(callsite_t *const *) a, profile_order);
+    size_t kb = callsite_key(*(callsite_t *const *) b, profile_order);
+    return (ka < kb) - (ka > kb);
+}
+
+void alloc_profile_report(alloc_order_t order, int n)
+{
+    pthread_mutex_lock(&profile_lock);
+    callsite_t *top[PROFILE_SITES];
+    size_t ntop = 0;
+    for (size_t i = 0; i < PROFILE_SITES; i++) {
+        if (callsites[i].caller)
+            top[ntop++] = &callsites[i];
+    }
+    profile_order = order;
+    qsort(top, ntop, sizeof(top[0]), callsite_cmp);
+
+    report(1, "%-32s %-6s %10s %12s %12s %14s %12s", "Call site", "Via",
+           "Count", "Bytes", "Peak bytes", "Size class", "Lifetime/us");
+    for (size_t i = 0; i < ntop && i < (size_t) n; i++) {
+        callsite_t *c = top[i];
+        char name[64];
+        callsite_name(c->caller, name, sizeof(name));
+
+        int k = 0;
+        for (int j = 1; j < SIZE_CLASSES; j++) {
+            if (c->classes[j] > c->classes[k])
+                k = j;
+        }
+        char class[48];
+        if (k)
+            snprintf(class, sizeof(class), "%zu-%zu",
+                     ((size_t) 1 << (k - 1)) + 1, (size_t) 1 << k);
+        else
+            snprintf(class, sizeof(class), "0-1");
+
+        char lifetime[32] = "-";
+        if (c->freed)
+            snprintf(lifetime, sizeof(lifetime), "%.1f",
+                     c->lifetime / 1e3 / c->freed);
+
+        report(1, "%-32s %-6s %10zu %12zu %12zu %14s %12s", name, c->fn,
+               c->count, c->bytes, c->peak_bytes, class, lifetime);
+    }
+    pthread_mutex_unlock(&profile_lock);
+}
+
+void alloc_profile_reset()
+{
+    pthread_mutex_lock(&profile_lock);
+    memset(callsites, 0, sizeof(callsites));
+    ncallsites = 0;
+    profile_generation++;
+    pthread_mutex_unlock(&profile_lock);
 }
 
 /* Implementation of functions for testing */
@@ -261,9 +720,7 @@ void set_noallocate_mode(bool noallocate)
 /* Return whether any errors have occurred since last time set error limit */
 bool error_check()
 {
-    bool e = error_occurred;
-    error_occurred = false;
-    return e;
+    return atomic_exchange(&error_occurred, false);
 }
 
 /* Prepare for a risky operation using setjmp.
@@ -8,22 +8,57 @@
 /* This test harness enables us to do stringent testing of code.
  * It overloads the library versions of malloc and free with ones that
  * allow checking for common allocation errors.
+ *
+ * Allocation functions may be called from several threads. Each thread keeps
+ * its own list of blocks and exception context.
  */
 
 void *test_malloc(size_t size);
 void *test_calloc(size_t nmemb, size_t size);
 void test_free(void *p);
 char *test_strdup(const char *s);
+/* Like test_malloc, but the block is profiled as allocated by fn on behalf of
+ * the function returning to caller, for allocators which carve blocks up and
+ * would otherwise hide who their memory is for.
+ */
+void *test_malloc_at(size_t size, void *caller, const char *fn);
 /* FIXME: provide test_realloc as well */
 
 #ifdef INTERNAL
 
-/* Report number of allocated blocks */
+/* Report number of allocated blocks, by all threads */
 size_t allocation_check();
 
 /* Probability of malloc failing, expressed as percent */
 extern int fail_probability;
 
+/* Nonzero to allocate blocks in fast mode, which keeps the magic numbers
+ * around blocks and their count, but neither fills them nor tracks them in
+ * any list, so that timings reflect the tested code rather than the harness.
+ * Freed blocks are still checked for corruption, but cautious mode no longer
+ * applies to them.
+ */
+extern int fast_mode;
+
+/* Nonzero to record, for every call site of the allocation functions, the
+ * number, sizes and lifetimes of the blocks it allocates.
+ */
+extern int alloc_profile;
+
+typedef enum {
+    ALLOC_BY_COUNT,
+    ALLOC_BY_BYTES,
+    ALLOC_BY_PEAK,
+} alloc_order_t;
+
+/* Report the n call sites allocating the most blocks, bytes, or bytes live
+ * at the same time, depending on order.
+ */
+void alloc_profile_report(alloc_order_t order, int n);
+
+/* Forget the statistics recorded so far */
+void alloc_profile_reset();
+
 /*
  * Set/unset cautious mode.
  * In this mode, makes extra sure any block to be freed is currently allocated.
@@ -39,7 +74,7 @@ void set_noallocate_mode(bool noallocate);
 /* Return whether any errors have occurred since last time checked */
 bool error_check();
 
-/* Prepare for a risky operation using setjmp.
+/* Prepare for a risky operation of the calling thread using setjmp.
  * Function returns true for initial return, false for error return
  */
 bool exception_setup(bool limit_time);
@@ -47,16 +82,21 @@ bool exception_setup(bool limit_time);
 /* Call once past risky code */
 void exception_cancel();
 
-/* Use longjmp to return to most recent exception setup.  Include error message
+/* Use longjmp to return to most recent exception setup of the calling thread.
+ * Include error message
  */
 void trigger_exception(char *msg);
 
+/* Code built on either side of the harness may name the allocation site */
+#define malloc_at(size, caller, fn) malloc(size)
+
 #else /* !INTERNAL */
 
 /* Tested program use our versions of malloc and free */
 #define malloc test_malloc
 #define calloc test_calloc
 #define free test_free
+#define malloc_at test_malloc_at
 
 /* Use undef to avoid strdup redefined error */
 #undef strdup
@@ -0,0 +1,259 @@
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Nodes are shared between threads, so use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "lfqueue.h"
+#include "list_sort.h"
+
+/* Hazard pointers each thread holds at most */
+#define LFQ_HAZARDS 2
+
+/* Retired nodes a thread accumulates before trying to free them. Being
+ * larger than the total number of hazard pointers, every scan frees some.
+ */
+#define LFQ_RETIRE_MAX (2 * LFQ_HAZARDS * LFQ_MAX_THREADS)
+
+struct lfq_node {
+    _Atomic(struct lfq_node *) next;
+    element_t *element;
+};
+
+/**
+ * struct lfq_record - Per-thread state of a queue
+ * @hazard: nodes the thread is about to access, which must not be freed
+ * @active: whether a thread is registered with this slot
+ * @nretired: number of entries in @retired
+ * @retired: nodes removed by the thread, waiting to be freed
+ *
+ * Records are aligned on cache lines so that threads do not share one.
+ */
+struct lfq_record {
+    _Atomic(struct lfq_node *) hazard[LFQ_HAZARDS];
+    atomic_bool active;
+    size_t nretired;
+    struct lfq_node *retired[LFQ_RETIRE_MAX];
+} __attribute__((aligned(64)));
+
+/* Removal goes through head and insertion through tail, which point to a
+ * dummy node and to the last node respectively.
+ */
+struct lfqueue {
+    _Atomic(struct lfq_node *) head __attribute__((aligned(64)));
+    _Atomic(struct lfq_node *) tail __attribute__((aligned(64)));
+    struct lfq_record records[LFQ_MAX_THREADS];
+};
+
+lfqueue_t *lfq_new(void)
+{
+    lfqueue_t *q;
+    if (posix_memalign((void **) &q, 64, sizeof(*q)))
+        return NULL;
+
+    struct lfq_node *dummy = malloc(sizeof(*dummy));
+    if (!dummy) {
+        free(q);
+        return NULL;
+    }
+    atomic_init(&dummy->next, NULL);
+    dummy->element = NULL;
+    atomic_init(&q->head, dummy);
+    atomic_init(&q->tail, dummy);
+
+    for (int i = 0; i < LFQ_MAX_THREADS; i++) {
+        struct lfq_record *rec = &q->records[i];
+        for (int j = 0; j < LFQ_HAZARDS; j++)
+            atomic_init(&rec->hazard[j], NULL);
+        atomic_init(&rec->active, false);
+        rec->nretired = 0;
+    }
+    return q;
+}
+
+void lfq_free(lfqueue_t *q)
+{
+    if (!q)
+        return;
+
+    for (int i = 0; i < LFQ_MAX_THREADS; i++) {
+        struct lfq_record *rec = &q->records[i];
+        for (size_t j = 0; j < rec->nretired; j++)
+            free(rec->retired[j]);
+    }
+
+    /* The element of the dummy node was handed out already */
+    struct lfq_node *node = atomic_load(&q->head);
+    struct lfq_node *next = atomic_load(&node->next);
+    free(node);
+    for (node = next; node; node = next) {
+        next = atomic_load(&node->next);
+        lfq_element_free(node->element);
+        free(node);
+    }
+    free(q);
+}
+
+int lfq_register(lfqueue_t *q)
+{
+    for (int i = 0; i < LFQ_MAX_THREADS; i++) {
+        bool expected = false;
+        if (atomic_compare_exchange_strong(&q->records[i].active, &expected,
+                                           true))
+            return i;
+    }
+    return -1;
+}
+
+/* Free every retired node of the record no thread holds a hazard pointer to,
+ * and keep the others for a later scan.
+ */
+static void lfq_scan(lfqueue_t *q, struct lfq_record *rec)
+{
+    struct lfq_node *hazards[LFQ_HAZARDS * LFQ_MAX_THREADS];
+    size_t nhazards = 0;
+
+    for (int i = 0; i < LFQ_MAX_THREADS; i++) {
+        for (int j = 0; j < LFQ_HAZARDS; j++) {
+            struct lfq_node *node = atomic_load(&q->records[i].hazard[j]);
+            if (node)
+                hazards[nhazards++] = node;
+        }
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < rec->nretired; i++) {
+        struct lfq_node *node = rec->retired[i];
+        bool hazardous = false;
+        for (size_t j = 0; j < nhazards && !hazardous; j++)
+            hazardous = hazards[j] == node;
+        if (hazardous)
+            rec->retired[kept++] = node;
+        else
+            free(node);
+    }
+    rec->nretired = kept;
+}
+
+void lfq_unregister(lfqueue_t *q, int slot)
+{
+    struct lfq_record *rec = &q->records[slot];
+    for (int j = 0; j < LFQ_HAZARDS; j++)
+        atomic_store(&rec->hazard[j], NULL);
+
+    /* Nodes still in use stay retired, for the next owner of the slot */
+    lfq_scan(q, rec);
+    atomic_store(&rec->active, false);
+}
+
+/* Publish a hazard pointer to the node *src points to, and return the node
+ * once *src is seen to still point to it. From then on, the node cannot be
+ * freed until the hazard pointer is cleared.
+ */
+static struct lfq_node *lfq_protect(_Atomic(struct lfq_node *) *hazard,
+                                    _Atomic(struct lfq_node *) *src)
+{
+    struct lfq_node *node = atomic_load(src);
+    for (;;) {
+        atomic_store(hazard, node);
+        struct lfq_node *again = atomic_load(src);
+        if (again == node)
+            return node;
+        node = again;
+    }
+}
+
+bool lfq_insert_tail(lfqueue_t *q, int slot, element_t *e)
+{
+    struct lfq_node *node = malloc(sizeof(*node));
+    if (!node)
+        return false;
+    atomic_init(&node->next, NULL);
+    node->element = e;
+
+    struct lfq_record *rec = &q->records[slot];
+    for (;;) {
+        struct lfq_node *tail = lfq_protect(&rec->hazard[0], &q->tail);
+        struct lfq_node *next = atomic_load(&tail->next);
+        if (tail != atomic_load(&q->tail))
+            continue;
+
+        /* Help a concurrent insertion which did not swing tail yet */
+        if (next) {
+            atomic_compare_exchange_weak(&q->tail, &tail, next);
+            continue;
+        }
+
+        struct lfq_node *expected = NULL;
+        if (atomic_compare_exchange_weak(&tail->next, &expected, node)) {
+            atomic_compare_exchange_strong(&q->tail, &tail, node);
+            break;
+        }
+    }
+    atomic_store(&rec->hazard[0], NULL);
+    return true;
+}
+
+element_t *lfq_remove_head(lfqueue_t *q, int slot)
+{
+    struct lfq_record *rec = &q->records[slot];
+    struct lfq_node *head;
+    element_t *e;
+
+    for (;;) {
+        head = lfq_protect(&rec->hazard[0], &q->head);
+        struct lfq_node *tail = atomic_load(&q->tail);
+        struct lfq_node *next = lfq_protect(&rec->hazard[1], &head->next);
+        if (head != atomic_load(&q->head))
+            continue;
+
+        if (!next) {
+            e = NULL;
+            head = NULL;
+            break;
+        }
+
+        /* Keep tail from falling behind head */
+        if (head == tail) {
+            atomic_compare_exchange_weak(&q->tail, &tail, next);
+            continue;
+        }
+
+        /* next becomes the dummy node, its element is handed out */
+        e = next->element;
+        if (atomic_compare_exchange_weak(&q->head, &head, next))
+            break;
+    }
+    atomic_store(&rec->hazard[0], NULL);
+    atomic_store(&rec->hazard[1], NULL);
+
+    if (head) {
+        rec->retired[rec->nretired++] = head;
+        if (rec->nretired == LFQ_RETIRE_MAX)
+            lfq_scan(q, rec);
+    }
+    return e;
+}
+
+element_t *lfq_element_new(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    size_t extra = len > Q_INLINE_SIZE ? len : 0;
+    element_t *e = malloc(sizeof(*e) + extra);
+    if (!e)
+        return NULL;
+
+    e->value = extra ? (char *) (e + 1) : e->inline_value;
+    memcpy(e->value, s, len);
+    e->key = element_key(s, len - 1);
+    e->slab = NULL;
+    INIT_LIST_HEAD(&e->list);
+    return e;
+}
+
+void lfq_element_free(element_t *e)
+{
+    free(e);
+}
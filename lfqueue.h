@@ -0,0 +1,59 @@
+#ifndef LAB0_LFQUEUE_H
+#define LAB0_LFQUEUE_H
+
+/* Lock-free multi-producer/multi-consumer queue of elements.
+ *
+ * This is the queue of Michael and Scott, see "Simple, Fast, and Practical
+ * Non-Blocking and Blocking Concurrent Queue Algorithms", PODC 1996. Removed
+ * nodes are reclaimed with hazard pointers, see Maged Michael, "Hazard
+ * Pointers: Safe Memory Reclamation for Lock-Free Objects", IEEE TPDS 2004.
+ *
+ * Every thread using a queue first registers with it, and passes the slot it
+ * got to every operation. Memory comes from the C library rather than from
+ * the test harness, which is not thread-safe.
+ */
+
+#include <stdbool.h>
+
+#include "queue.h"
+
+/* Maximum number of threads registered with a queue at the same time */
+#define LFQ_MAX_THREADS 64
+
+typedef struct lfqueue lfqueue_t;
+
+/* Create an empty queue. Return NULL if allocation failed. */
+lfqueue_t *lfq_new(void);
+
+/* Free the queue along with the elements still in it. No thread may be using
+ * the queue any more.
+ */
+void lfq_free(lfqueue_t *q);
+
+/* Register the calling thread with the queue.
+ * Return its slot, or -1 if LFQ_MAX_THREADS threads are registered already.
+ */
+int lfq_register(lfqueue_t *q);
+
+/* Give the slot of a thread done with the queue back */
+void lfq_unregister(lfqueue_t *q, int slot);
+
+/* Insert an element at tail of queue.
+ * Return false if no node could be allocated for it.
+ */
+bool lfq_insert_tail(lfqueue_t *q, int slot, element_t *e);
+
+/* Remove the element at head of queue.
+ * Return NULL if queue is empty.
+ */
+element_t *lfq_remove_head(lfqueue_t *q, int slot);
+
+/* Allocate an element holding a copy of s, to be inserted into a queue.
+ * Return NULL if allocation failed.
+ */
+element_t *lfq_element_new(const char *s);
+
+/* Free an element allocated by lfq_element_new() */
+void lfq_element_free(element_t *e);
+
+#endif /* LAB0_LFQUEUE_H */
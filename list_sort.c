@@ -0,0 +1,348 @@
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include "list_sort.h"
+
+bool cmp(const struct list_head *a, const struct list_head *b, bool descend)
+{
+    element_t const *e1 = list_entry(a, element_t, list);
+    element_t const *e2 = list_entry(b, element_t, list);
+
+    if (descend)
+        return element_cmp(e1, e2) >= 0;
+
+    return element_cmp(e1, e2) <= 0;
+}
+
+struct list_head *merge(bool descend, struct list_head *a, struct list_head *b)
+{
+    struct list_head *head = NULL, **tail = &head;
+
+    for (;;) {
+        if (cmp(a, b, descend)) {
+            *tail = a;
+            tail = &a->next;
+            a = a->next;
+            if (!a) {
+                *tail = b;
+                break;
+            }
+        } else {
+            *tail = b;
+            tail = &b->next;
+            b = b->next;
+            if (!b) {
+                *tail = a;
+                break;
+            }
+        }
+    }
+    return head;
+}
+
+void merge_final(bool descend,
+                 struct list_head *head,
+                 struct list_head *a,
+                 struct list_head *b)
+{
+    struct list_head *tail = head;
+
+    for (;;) {
+        if (cmp(a, b, descend)) {
+            tail->next = a;
+            a->prev = tail;
+            tail = a;
+            a = a->next;
+            if (!a)
+                break;
+        } else {
+            tail->next = b;
+            b->prev = tail;
+            tail = b;
+            b = b->next;
+            if (!b) {
+                b = a;
+                break;
+            }
+        }
+    }
+
+    tail->next = b;
+    do {
+        b->prev = tail;
+        tail = b;
+        b = b->next;
+    } while (b);
+
+    tail->next = head;
+    head->prev = tail;
+}
+
+/* Detach the longest run at the front of a NULL-terminated list: either
+ * non-decreasing, or strictly decreasing and then reversed in place, which
+ * keeps the sort stable. Store its length in *len and what follows it in
+ * *rest, and return the now sorted run.
+ */
+static struct list_head *run_take(struct list_head *list,
+                                  bool descend,
+                                  size_t *len,
+                                  struct list_head **rest)
+{
+    struct list_head *node = list->next;
+    size_t n = 1;
+
+    if (node && !cmp(list, node, descend)) {
+        struct list_head *run = list;
+
+        list->next = NULL;
+        for (;;) {
+            struct list_head *next = node->next;
+
+            node->next = run;
+            run = node;
+            n++;
+            if (!next || cmp(node, next, descend)) {
+                node = next;
+                break;
+            }
+            node = next;
+        }
+        *len = n;
+        *rest = node;
+        return run;
+    }
+
+    for (node = list; node->next && cmp(node, node->next, descend);
+         node = node->next)
+        n++;
+    *rest = node->next;
+    node->next = NULL;
+    *len = n;
+    return list;
+}
+
+/* Powersort priority of the boundary between the adjacent runs starting at
+ * s1 of length n1 and of length n2, within a list of n elements: the depth
+ * of the first level where a perfectly balanced merge tree would split
+ * their midpoints apart.
+ */
+static unsigned int run_power(size_t s1, size_t n1, size_t n2, size_t n)
+{
+    size_t a = 2 * s1 + n1, b = a + n1 + n2;
+    unsigned int power = 0;
+
+    for (;;) {
+        power++;
+        if (a >= n) {
+            a -= n;
+            b -= n;
+        } else if (b >= n) {
+            break;
+        }
+        a <<= 1;
+        b <<= 1;
+    }
+    return power;
+}
+
+/* Powers on the run stack strictly increase and are bounded by the number of
+ * bits in a size_t plus one.
+ */
+#define SORT_MAX_RUNS (sizeof(size_t) * CHAR_BIT + 2)
+
+struct sort_run {
+    struct list_head *list;
+    size_t start, len;
+    unsigned int power;
+};
+
+/* Merge the two topmost runs of the stack, the earlier one winning ties */
+static inline void run_collapse(struct sort_run *stack, int *top, bool descend)
+{
+    struct sort_run *a = &stack[*top - 1], *b = &stack[*top];
+
+    a->list = merge(descend, a->list, b->list);
+    a->len += b->len;
+    (*top)--;
+}
+
+/* Split a NULL-terminated list of n nodes linked through next into natural
+ * runs and merge them following the powersort policy, stopping when two
+ * runs are left. These are stored in *a and *b, *b being NULL if the list
+ * turned out to be a single run. Sorted input thus takes n - 1 comparisons.
+ */
+static void sort_runs(struct list_head *list,
+                      bool descend,
+                      size_t n,
+                      struct list_head **a,
+                      struct list_head **b)
+{
+    struct sort_run stack[SORT_MAX_RUNS];
+    int top = 0;
+
+    stack[0].start = 0;
+    stack[0].list = run_take(list, descend, &stack[0].len, &list);
+    while (list) {
+        struct sort_run run;
+
+        run.start = stack[top].start + stack[top].len;
+        run.list = run_take(list, descend, &run.len, &list);
+        run.power = run_power(stack[top].start, stack[top].len, run.len, n);
+        while (top > 0 && stack[top].power > run.power)
+            run_collapse(stack, &top, descend);
+        stack[++top] = run;
+    }
+
+    while (top > 1)
+        run_collapse(stack, &top, descend);
+
+    *a = stack[0].list;
+    *b = top ? stack[1].list : NULL;
+}
+
+/* Sort a NULL-terminated list of n nodes linked through next, leaving prev
+ * pointers unspecified. Return the first node of the sorted list.
+ */
+static struct list_head *sort_list(struct list_head *list,
+                                   bool descend,
+                                   size_t n)
+{
+    struct list_head *a, *b;
+
+    sort_runs(list, descend, n, &a, &b);
+    return b ? merge(descend, a, b) : a;
+}
+
+/* Number of threads list_sort() spreads a list over */
+int q_sort_threads = 1;
+
+#define SORT_MAX_THREADS 64
+
+/* Below this many elements per thread, spawning threads does not pay off */
+#define SORT_MIN_PER_THREAD 16384
+
+/* A unit of work for a sorting thread: sort a alone if b is NULL, otherwise
+ * merge a and b. The result is left in a.
+ */
+struct sort_job {
+    struct list_head *a, *b;
+    size_t n;
+    bool descend;
+};
+
+static void *sort_job_run(void *arg)
+{
+    struct sort_job *job = arg;
+    job->a = job->b ? merge(job->descend, job->a, job->b)
+                    : sort_list(job->a, job->descend, job->n);
+    return NULL;
+}
+
+/* Run every job but the first on a thread of its own, and the first one on
+ * the calling thread. Jobs whose thread cannot be created run inline.
+ */
+static void sort_jobs_run(struct sort_job *jobs, int n)
+{
+    pthread_t tids[SORT_MAX_THREADS];
+    bool spawned[SORT_MAX_THREADS];
+
+    for (int i = 1; i < n; i++)
+        spawned[i] = !pthread_create(&tids[i], NULL, sort_job_run, &jobs[i]);
+
+    sort_job_run(&jobs[0]);
+    for (int i = 1; i < n; i++) {
+        if (spawned[i])
+            pthread_join(tids[i], NULL);
+        else
+            sort_job_run(&jobs[i]);
+    }
+}
+
+/* Cut the n elements of the queue into nthreads consecutive sublists, sort
+ * them concurrently, then merge neighbours pairwise until two lists are left
+ * for merge_final(). The earlier sublist wins ties, so the sort stays stable.
+ */
+static void sort_parallel(struct list_head *head,
+                          bool descend,
+                          int nthreads,
+                          size_t n)
+{
+    struct sort_job jobs[SORT_MAX_THREADS];
+    struct list_head *node = head->next;
+
+    head->prev->next = NULL;
+    for (int i = 0; i < nthreads; i++) {
+        size_t len = n / nthreads + ((size_t) i < n % nthreads);
+        jobs[i] = (struct sort_job){
+            .a = node, .b = NULL, .n = len, .descend = descend};
+        while (--len)
+            node = node->next;
+        struct list_head *next = node->next;
+        node->next = NULL;
+        node = next;
+    }
+
+    /* The time limit is enforced by SIGALRM, whose handler longjmps back to
+     * qtest. Hold it off until every thread is done with the list.
+     */
+    sigset_t set, oldset;
+    sigemptyset(&set);
+    sigaddset(&set, SIGALRM);
+    pthread_sigmask(SIG_BLOCK, &set, &oldset);
+
+    sort_jobs_run(jobs, nthreads);
+
+    int cnt = nthreads;
+    while (cnt > 2) {
+        int pairs = cnt / 2;
+        for (int i = 0; i < pairs; i++) {
+            jobs[i].a = jobs[2 * i].a;
+            jobs[i].b = jobs[2 * i + 1].a;
+        }
+        sort_jobs_run(jobs, pairs);
+        for (int i = 0; i < pairs; i++)
+            jobs[i].b = NULL;
+        if (cnt & 1)
+            jobs[pairs] = jobs[cnt - 1];
+        cnt = pairs + (cnt & 1);
+    }
+    merge_final(descend, head, jobs[0].a, jobs[1].a);
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+}
+
+void list_sort(struct list_head *head, bool descend, size_t n)
+{
+    if (n < 2)
+        return;
+
+    int nthreads = q_sort_threads;
+    if (nthreads > SORT_MAX_THREADS)
+        nthreads = SORT_MAX_THREADS;
+    if (n / SORT_MIN_PER_THREAD < (size_t) nthreads)
+        nthreads = n / SORT_MIN_PER_THREAD;
+    if (nthreads > 1) {
+        sort_parallel(head, descend, nthreads, n);
+        return;
+    }
+
+    struct list_head *a, *b;
+
+    head->prev->next = NULL;
+    sort_runs(head->next, descend, n, &a, &b);
+    if (b) {
+        merge_final(descend, head, a, b);
+        return;
+    }
+
+    /* Already sorted, only the prev links need to be restored */
+    struct list_head *prev = head;
+    for (; a; a = a->next) {
+        a->prev = prev;
+        prev->next = a;
+        prev = a;
+    }
+    prev->next = head;
+    head->prev = prev;
+}
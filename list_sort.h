@@ -0,0 +1,61 @@
+#ifndef LAB0_LIST_SORT_H
+#define LAB0_LIST_SORT_H
+
+/* Stable merge sort of lists of queue elements, shared by every queue
+ * implementation. Natural runs are detected and merged following the
+ * powersort policy, and large lists can be spread over several threads.
+ */
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "list.h"
+#include "queue.h"
+
+/* Pack the first 8 bytes of the string s of length len big-endian into the
+ * key of an element, zero padded.
+ */
+static inline uint64_t element_key(const char *s, size_t len)
+{
+    uint64_t key = 0;
+    for (size_t i = 0; i < sizeof(key) && i < len; i++)
+        key |= (uint64_t) (unsigned char) s[i] << (56 - 8 * i);
+    return key;
+}
+
+/* Compare two elements like strcmp() does with their strings. The cached key
+ * prefixes settle most comparisons without touching the strings at all.
+ */
+static inline int element_cmp(const element_t *e1, const element_t *e2)
+{
+    if (e1->key != e2->key)
+        return e1->key < e2->key ? -1 : 1;
+
+    /* A zero last byte means both strings ended within the prefix */
+    if (!(e1->key & 0xff))
+        return 0;
+    return strcmp(e1->value + sizeof(e1->key), e2->value + sizeof(e2->key));
+}
+
+/* Return true if the element of a may precede the one of b */
+bool cmp(const struct list_head *a, const struct list_head *b, bool descend);
+
+/* Merge two sorted NULL-terminated lists linked through next. Elements of a
+ * come first among equal ones.
+ */
+struct list_head *merge(bool descend, struct list_head *a, struct list_head *b);
+
+/* Merge like merge() into the list headed by head, restoring prev links */
+void merge_final(bool descend,
+                 struct list_head *head,
+                 struct list_head *a,
+                 struct list_head *b);
+
+/* Sort the n elements of the circular list headed by head, using up to
+ * q_sort_threads threads.
+ */
+void list_sort(struct list_head *head, bool descend, size_t n);
+
+#endif /* LAB0_LIST_SORT_H */
@@ -0,0 +1,157 @@
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "perf.h"
+#include "report.h"
+
+#define CACHE_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} events[PERF_COUNTERS] = {
+    [PERF_CYCLES] = {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [PERF_INSTRUCTIONS] = {"instructions", PERF_TYPE_HARDWARE,
+                           PERF_COUNT_HW_INSTRUCTIONS},
+    [PERF_L1D_MISSES] = {"L1d", PERF_TYPE_HW_CACHE,
+                         CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    [PERF_LLC_MISSES] = {"LLC", PERF_TYPE_HW_CACHE,
+                         CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+    [PERF_BRANCH_MISSES] = {"branch", PERF_TYPE_HARDWARE,
+                            PERF_COUNT_HW_BRANCH_MISSES},
+    [PERF_DTLB_MISSES] = {"dTLB", PERF_TYPE_HW_CACHE,
+                          CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+};
+
+int perf_enabled = 0;
+
+/* Descriptors of the counters of the thread, the one of cycles leading the
+ * group, and the counters in the order the group is read in.
+ */
+static __thread int fds[PERF_COUNTERS] = {-1, -1, -1, -1, -1, -1};
+static __thread perf_counter_t order[PERF_COUNTERS];
+static __thread int nopen;
+
+static int open_event(perf_counter_t c, int group_fd)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = events[c].type;
+    attr.config = events[c].config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.disabled = group_fd < 0;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+}
+
+bool perf_open(void)
+{
+    if (nopen)
+        return true;
+
+    fds[PERF_CYCLES] = open_event(PERF_CYCLES, -1);
+    if (fds[PERF_CYCLES] < 0) {
+        report(1, "Warning: Hardware counters are unavailable: %s",
+               strerror(errno));
+        return false;
+    }
+    order[nopen++] = PERF_CYCLES;
+
+    for (perf_counter_t c = PERF_CYCLES + 1; c < PERF_COUNTERS; c++) {
+        fds[c] = open_event(c, fds[PERF_CYCLES]);
+        if (fds[c] >= 0)
+            order[nopen++] = c;
+    }
+
+    ioctl(fds[PERF_CYCLES], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+    ioctl(fds[PERF_CYCLES], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    return true;
+}
+
+bool perf_opened(void)
+{
+    return nopen;
+}
+
+void perf_close(void)
+{
+    for (int c = 0; c < PERF_COUNTERS; c++) {
+        if (fds[c] >= 0)
+            close(fds[c]);
+        fds[c] = -1;
+    }
+    nopen = 0;
+}
+
+bool perf_read(perf_sample_t *s)
+{
+    uint64_t buf[3 + PERF_COUNTERS];
+    if (!nopen || read(fds[PERF_CYCLES], buf, sizeof(buf)) <= 0)
+        return false;
+
+    /* Counters sharing the hardware with others only ran part of the time */
+    uint64_t enabled = buf[1], running = buf[2];
+    double scale = running ? (double) enabled / running : 0;
+
+    s->valid = 0;
+    for (uint64_t i = 0; i < buf[0]; i++) {
+        s->value[order[i]] = buf[3 + i] * scale;
+        s->valid |= running ? 1U << order[i] : 0;
+    }
+    return true;
+}
+
+void perf_add(perf_sample_t *total,
+              const perf_sample_t *before,
+              const perf_sample_t *after)
+{
+    total->valid |= before->valid & after->valid;
+    for (int c = 0; c < PERF_COUNTERS; c++)
+        total->value[c] += after->value[c] - before->value[c];
+}
+
+void perf_sum(perf_sample_t *total, const perf_sample_t *s)
+{
+    total->valid |= s->valid;
+    for (int c = 0; c < PERF_COUNTERS; c++)
+        total->value[c] += s->value[c];
+}
+
+void perf_report(const char *what, const perf_sample_t *s)
+{
+    if (!(s->valid & 1U << PERF_CYCLES))
+        return;
+
+    double cycles = s->value[PERF_CYCLES];
+    double instructions = s->value[PERF_INSTRUCTIONS];
+    if (!(s->valid & 1U << PERF_INSTRUCTIONS)) {
+        report(1, "%s: %.0f cycles", what, cycles);
+        return;
+    }
+    report(1, "%s: %.0f cycles, %.0f instructions, IPC %.2f", what, cycles,
+           instructions, cycles ? instructions / cycles : 0);
+
+    /* Misses per thousand instructions, of the counters there are */
+    char line[256];
+    int len = 0;
+    for (int c = PERF_L1D_MISSES; c < PERF_COUNTERS; c++) {
+        if (!(s->valid & 1U << c) || !instructions)
+            continue;
+        len += snprintf(line + len, sizeof(line) - len, "%s %s %.2f",
+                        len ? "," : "", events[c].name,
+                        s->value[c] * 1000 / instructions);
+    }
+    if (len)
+        report(1, "%s: misses per 1000 instructions:%s", what, line);
+}
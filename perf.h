@@ -0,0 +1,65 @@
+#ifndef LAB0_PERF_H
+#define LAB0_PERF_H
+
+/* Hardware performance counters, through perf_event_open(2).
+ *
+ * The counters of a thread form one group, scheduled onto the hardware
+ * together, and count that thread only, in user space only. Counters the
+ * kernel or the hardware denies are left out; without cycles, there is no
+ * group at all.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_COUNTERS,
+} perf_counter_t;
+
+/**
+ * perf_sample_t - Counts of the counters of a group
+ * @value: count of every counter, scaled up when it was multiplexed
+ * @valid: bit i is set if @value[i] was counted
+ */
+typedef struct {
+    double value[PERF_COUNTERS];
+    unsigned valid;
+} perf_sample_t;
+
+/* Whether commands and dudect measurements are counted, the perf option */
+extern int perf_enabled;
+
+/* Open the counters of the calling thread, unless they are open already.
+ * Return false if the kernel denied them.
+ */
+bool perf_open(void);
+
+/* Whether the counters of the calling thread are open */
+bool perf_opened(void);
+
+/* Close the counters of the calling thread */
+void perf_close(void);
+
+/* Read the counters of the calling thread.
+ * Return false if they are not open or could not be read.
+ */
+bool perf_read(perf_sample_t *s);
+
+/* Add the counts from before to after to total, which starts out zeroed */
+void perf_add(perf_sample_t *total,
+              const perf_sample_t *before,
+              const perf_sample_t *after);
+
+/* Add the counts of s to total, which starts out zeroed */
+void perf_sum(perf_sample_t *total, const perf_sample_t *s);
+
+/* Report the counts of a sample along with IPC and miss rates */
+void perf_report(const char *what, const perf_sample_t *s);
+
+#endif /* LAB0_PERF_H */
@@ -0,0 +1,182 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "list_sort.h"
+#include "pool.h"
+
+/* Slabs start small so that short-lived queues stay cheap, then double up to
+ * POOL_SLAB_MAX bytes as the queue grows.
+ */
+#define POOL_SLAB_MIN 4096
+#define POOL_SLAB_MAX (1 << 20)
+
+/* Elements start at cache line boundaries, so that accessing one touches a
+ * single line wherever it lies in its slab
+ */
+#define POOL_LINE 64
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((size_t) (a) - 1))
+
+/* The slabs and spilled strings of a pool are accounted to the caller of the
+ * pool, which the profiler of the harness could not tell apart otherwise.
+ */
+static struct pool_slab *slab_new(pool_t *pool, size_t size, void *caller)
+{
+    struct pool_slab *slab =
+        malloc_at(sizeof(struct pool_slab) + size, caller, "slab");
+    if (!slab)
+        return NULL;
+
+    slab->pool = pool;
+    slab->size = size;
+    slab->used = 0;
+    list_add_tail(&slab->list, &pool->slabs);
+    return slab;
+}
+
+/* Offset from the data of slab to the first address past its used bytes
+ * which is a multiple of align. Slabs are only aligned as malloc aligns them.
+ */
+static inline size_t slab_offset(const struct pool_slab *slab, size_t align)
+{
+    uintptr_t data = (uintptr_t) slab->data;
+    return ALIGN_UP(data + slab->used, align) - data;
+}
+
+/* Carve size bytes aligned to align out of the current slab, starting a new
+ * slab once it is exhausted. Requests larger than the next slab get a slab of
+ * their own, so that the current one keeps its remaining space.
+ */
+static void *pool_carve(pool_t *pool,
+                        size_t size,
+                        size_t align,
+                        void *caller)
+{
+    struct pool_slab *slab = pool->current;
+    if (slab) {
+        size_t offset = slab_offset(slab, align);
+        if (offset + size <= slab->size) {
+            slab->used = offset + size;
+            return slab->data + offset;
+        }
+    }
+
+    if (size + align > pool->next_size) {
+        slab = slab_new(pool, size + align, caller);
+        if (!slab)
+            return NULL;
+    } else {
+        slab = slab_new(pool, pool->next_size, caller);
+        if (!slab)
+            return NULL;
+        if (pool->next_size < POOL_SLAB_MAX)
+            pool->next_size <<= 1;
+        pool->current = slab;
+    }
+    size_t offset = slab_offset(slab, align);
+    slab->used = offset + size;
+    return slab->data + offset;
+}
+
+static inline struct pool_spill *spill_of(char *value)
+{
+    return (struct pool_spill *) (value - offsetof(struct pool_spill, data));
+}
+
+void pool_init(pool_t *pool)
+{
+    INIT_LIST_HEAD(&pool->slabs);
+    INIT_LIST_HEAD(&pool->free);
+    INIT_LIST_HEAD(&pool->spills);
+    pool->current = NULL;
+    pool->next_size = POOL_SLAB_MIN;
+
+    /* Having the first slab ready keeps the first insertion as cheap as any
+     * other one. Failing here is harmless, the slab is allocated on demand.
+     */
+    pool->current =
+        slab_new(pool, pool->next_size, __builtin_return_address(0));
+    if (pool->current)
+        pool->next_size <<= 1;
+}
+
+element_t *pool_alloc_element(pool_t *pool, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    element_t *e;
+
+    if (!list_empty(&pool->free)) {
+        e = list_first_entry(&pool->free, element_t, list);
+        list_del(&e->list);
+    } else {
+        e = pool_carve(pool, sizeof(element_t), POOL_LINE,
+                       __builtin_return_address(0));
+        if (!e)
+            return NULL;
+        e->slab = pool->current;
+    }
+
+    if (len <= sizeof(e->inline_value)) {
+        e->value = e->inline_value;
+    } else {
+        struct pool_spill *spill = malloc_at(
+            sizeof(*spill) + len, __builtin_return_address(0), "spill");
+        if (!spill) {
+            list_add(&e->list, &pool->free);
+            return NULL;
+        }
+        list_add(&spill->list, &pool->spills);
+        e->value = spill->data;
+    }
+    memcpy(e->value, s, len);
+
+    e->key = element_key(s, len - 1);
+
+    INIT_LIST_HEAD(&e->list);
+    return e;
+}
+
+void *pool_alloc(pool_t *pool, size_t size)
+{
+    return pool_carve(pool, size, __alignof__(max_align_t),
+                      __builtin_return_address(0));
+}
+
+void pool_free_element(element_t *e)
+{
+    if (e->value != e->inline_value) {
+        struct pool_spill *spill = spill_of(e->value);
+        list_del(&spill->list);
+        free(spill);
+    }
+    list_add(&e->list, &e->slab->pool->free);
+}
+
+void pool_adopt(pool_t *to, pool_t *from)
+{
+    struct pool_slab *slab;
+    list_for_each_entry(slab, &from->slabs, list)
+        slab->pool = to;
+
+    list_splice_tail_init(&from->slabs, &to->slabs);
+    list_splice_tail_init(&from->free, &to->free);
+    list_splice_tail_init(&from->spills, &to->spills);
+    from->current = NULL;
+}
+
+void pool_destroy(pool_t *pool)
+{
+    struct pool_slab *slab, *safe;
+    list_for_each_entry_safe(slab, safe, &pool->slabs, list)
+        free(slab);
+
+    struct pool_spill *spill, *next;
+    list_for_each_entry_safe(spill, next, &pool->spills, list)
+        free(spill);
+
+    INIT_LIST_HEAD(&pool->slabs);
+    INIT_LIST_HEAD(&pool->free);
+    INIT_LIST_HEAD(&pool->spills);
+    pool->current = NULL;
+}
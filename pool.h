@@ -0,0 +1,86 @@
+#ifndef LAB0_POOL_H
+#define LAB0_POOL_H
+
+/* Slab allocator for queue elements.
+ *
+ * Every queue owns a pool. Elements are carved out of large contiguous slabs,
+ * so that building a queue of n elements takes O(log n) calls to malloc
+ * instead of O(n), and freeing the queue releases whole slabs without
+ * visiting any element. Strings too long to be stored inline are allocated
+ * one by one, and freed as soon as their element is released.
+ */
+
+#include <stddef.h>
+
+#include "list.h"
+#include "queue.h"
+
+/**
+ * struct pool_slab - Contiguous chunk of memory elements are carved from
+ * @list: node in the list of slabs of the owning pool
+ * @pool: the pool currently owning this slab
+ * @size: number of bytes available in @data
+ * @used: number of bytes of @data handed out so far
+ * @data: storage for elements
+ */
+struct pool_slab {
+    struct list_head list;
+    struct pool *pool;
+    size_t size;
+    size_t used;
+    unsigned char data[];
+};
+
+/**
+ * struct pool_spill - String which did not fit inline in its element
+ * @list: node in the list of spilled strings of the owning pool
+ * @data: the string
+ */
+struct pool_spill {
+    struct list_head list;
+    char data[];
+};
+
+/**
+ * pool_t - Allocator owned by a single queue
+ * @slabs: all slabs owned by the pool
+ * @current: slab new elements are carved from, NULL if none yet
+ * @free: released elements awaiting reuse, linked through their @list
+ * @spills: strings of the elements in use which did not fit inline
+ * @next_size: size of the next slab to be allocated
+ */
+typedef struct pool {
+    struct list_head slabs;
+    struct pool_slab *current;
+    struct list_head free;
+    struct list_head spills;
+    size_t next_size;
+} pool_t;
+
+/* Initialize an empty pool, allocating its first slab if possible */
+void pool_init(pool_t *pool);
+
+/* Allocate an element holding a copy of s.
+ * Return NULL if allocation failed.
+ */
+element_t *pool_alloc_element(pool_t *pool, const char *s);
+
+/* Allocate size bytes suitably aligned for any object, only given back when
+ * the pool is destroyed. Return NULL if allocation failed.
+ */
+void *pool_alloc(pool_t *pool, size_t size);
+
+/* Hand an element back to the pool owning it */
+void pool_free_element(element_t *e);
+
+/* Move all slabs of pool from into pool to, leaving from empty.
+ * Elements carved from either pool stay valid and are afterwards owned by to.
+ */
+void pool_adopt(pool_t *to, pool_t *from);
+
+/* Release every slab and spilled string of the pool, invalidating all of its
+ * elements
+ */
+void pool_destroy(pool_t *pool);
+
+#endif /* LAB0_POOL_H */
@@ -44,8 +44,11 @@ extern int show_entropy;
  */
 #include "queue.h"
 
+#include "complexity.h"
 #include "console.h"
+#include "lfqueue.h"
 #include "report.h"
+#include "stress.h"
 
 /* Settable parameters */
 
@@ -53,7 +56,6 @@ extern int show_entropy;
 
 /* How large is a queue before it's considered big.
  * This affects how it gets printed
- * and whether cautious mode is used when freeing the queue
  */
 #define BIG_LIST_SIZE 30
 
@@ -75,6 +77,12 @@ static int string_length = MAXSTRING;
 
 static int descend = 0;
 
+/* Cross-check q_size() against a walk of the queue after every command */
+static int size_check = 0;
+
+/* Have the stress command use the two-lock queue, not the lock-free one */
+static int stress_two_lock = 0;
+
 #define MIN_RANDSTR_LEN 5
 #define MAX_RANDSTR_LEN 10
 static const char charset[] = "abcdefghijklmnopqrstuvwxyz";
@@ -104,9 +112,6 @@ static bool do_free(int argc, char *argv[])
     }
     error_check();
 
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
-
     struct list_head *qnext = NULL;
     if (chain.size > 1) {
         qnext = (current->chain.next == &chain.head) ? chain.head.next
@@ -119,7 +124,6 @@ static bool do_free(int argc, char *argv[])
         if (exception_setup(true))
             q_free(current->q);
         exception_cancel();
-        set_cautious_mode(true);
     }
 
     if (current) {
@@ -237,10 +241,8 @@ static bool queue_insert(position_t pos, int argc, char *argv[])
                                         : q_insert_head(current->q, inserts);
             if (rval) {
                 current->size++;
-                element_t *entry =
-                    pos == POS_TAIL
-                        ? list_last_entry(current->q, element_t, list)
-                        : list_first_entry(current->q, element_t, list);
+                element_t *entry = pos == POS_TAIL ? q_peek_tail(current->q)
+                                                   : q_peek_head(current->q);
                 char *cur_inserts = entry->value;
                 if (!cur_inserts) {
                     report(1, "ERROR: Failed to save copy of string in queue");
@@ -434,35 +436,34 @@ static bool do_dedup(int argc, char *argv[])
 
     LIST_HEAD(l_copy);
     element_t *item = NULL, *tmp = NULL;
+    q_iter_t it;
 
     // Copy current->q to l_copy
-    if (current->q && !list_empty(current->q)) {
-        list_for_each_entry(item, current->q, list) {
-            size_t slen;
-            tmp = malloc(sizeof(element_t));
-            if (!tmp)
-                break;
-            INIT_LIST_HEAD(&tmp->list);
-            slen = strlen(item->value) + 1;
-            tmp->value = malloc(slen);
-            if (!tmp->value) {
-                free(tmp);
-                break;
-            }
-            memcpy(tmp->value, item->value, slen);
-            list_add_tail(&tmp->list, &l_copy);
+    for (item = q_iter_first(&it, current->q); item; item = q_iter_next(&it)) {
+        size_t slen;
+        tmp = malloc(sizeof(element_t));
+        if (!tmp)
+            break;
+        INIT_LIST_HEAD(&tmp->list);
+        slen = strlen(item->value) + 1;
+        tmp->value = malloc(slen);
+        if (!tmp->value) {
+            free(tmp);
+            break;
         }
-        // Return false if the loop does not leave properly
-        if (&item->list != current->q) {
-            list_for_each_entry_safe(item, tmp, &l_copy, list) {
-                free(item->value);
-                free(item);
-            }
-            report(1,
-                   "INTERNAL ERROR.  Could not allocate space for "
-                   "duplicate checking");
-            return false;
+        memcpy(tmp->value, item->value, slen);
+        list_add_tail(&tmp->list, &l_copy);
+    }
+    // Return false if the loop does not leave properly
+    if (item) {
+        list_for_each_entry_safe(item, tmp, &l_copy, list) {
+            free(item->value);
+            free(item);
         }
+        report(1,
+               "INTERNAL ERROR.  Could not allocate space for "
+               "duplicate checking");
+        return false;
     }
 
     bool ok = true;
@@ -479,7 +480,7 @@ static bool do_dedup(int argc, char *argv[])
         return false;
     }
 
-    struct list_head *l_tmp = current->q->next;
+    element_t *e_tmp = q_iter_first(&it, current->q);
     bool is_this_dup = false;
     // Compare between new list and old one
     list_for_each_entry(item, &l_copy, list) {
@@ -491,16 +492,14 @@ static bool do_dedup(int argc, char *argv[])
         if (is_this_dup || is_next_dup) {
             // Update list size
             current->size--;
-        } else if (l_tmp != current->q &&
-                   strcmp(list_entry(l_tmp, element_t, list)->value,
-                          item->value) == 0)
-            l_tmp = l_tmp->next;
+        } else if (e_tmp && strcmp(e_tmp->value, item->value) == 0)
+            e_tmp = q_iter_next(&it);
         else
             ok = false;
         is_this_dup = is_next_dup;
     }
     // All elements in new list should be traversed
-    ok = ok && l_tmp == current->q;
+    ok = ok && !e_tmp;
     if (!ok)
         report(1,
                "ERROR: Duplicate strings are in queue or distinct strings are "
@@ -522,6 +521,16 @@ static bool do_reverse(int argc, char *argv[])
         return false;
     }
 
+    /* Reversing is linear, so the constant time tests must tell it apart */
+    if (simulation) {
+        if (is_reverse_const()) {
+            report(1, "ERROR: Linear reverse passed as constant time");
+            return false;
+        }
+        report(1, "Probably not constant time, as reverse should be");
+        return true;
+    }
+
     if (!current || !current->q)
         report(3, "Warning: Calling reverse on null queue");
     error_check();
@@ -603,12 +612,13 @@ bool do_sort(int argc, char *argv[])
  * stability of the sort. So, MAX_NODES is used to limit the number of elements
  * to check the stability of the sort. */
 #define MAX_NODES 100000
-    struct list_head *nodes[MAX_NODES];
+    element_t *nodes[MAX_NODES];
     unsigned no = 0;
     if (current && current->size && current->size <= MAX_NODES) {
-        element_t *entry;
-        list_for_each_entry(entry, current->q, list)
-            nodes[no++] = &entry->list;
+        q_iter_t it;
+        for (element_t *entry = q_iter_first(&it, current->q); entry;
+             entry = q_iter_next(&it))
+            nodes[no++] = entry;
     } else if (current && current->size > MAX_NODES)
         report(1,
                "Warning: Skip checking the stability of the sort because the "
@@ -622,12 +632,13 @@ bool do_sort(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
+        q_iter_t it;
+        element_t *item = q_iter_first(&it, current->q), *next_item;
+        for (; item && --cnt; item = next_item) {
             /* Ensure each element in ascending/descending order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item = q_iter_next(&it);
+            if (!next_item)
+                break;
             if (!descend && strcmp(item->value, next_item->value) > 0) {
                 report(1, "ERROR: Not sorted in ascending order");
                 ok = false;
@@ -644,11 +655,11 @@ bool do_sort(int argc, char *argv[])
                 !strcmp(item->value, next_item->value)) {
                 bool unstable = false;
                 for (unsigned i = 0; i < MAX_NODES; i++) {
-                    if (nodes[i] == cur_l->next) {
+                    if (nodes[i] == next_item) {
                         unstable = true;
                         break;
                     }
-                    if (nodes[i] == cur_l) {
+                    if (nodes[i] == item) {
                         break;
                     }
                 }
@@ -750,11 +761,12 @@ static bool do_ascend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+        q_iter_t it;
+        element_t *item = q_iter_first(&it, current->q), *next_item;
+        for (; item && --cnt; item = next_item) {
+            next_item = q_iter_next(&it);
+            if (!next_item)
+                break;
             if (strcmp(item->value, next_item->value) > 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
@@ -797,11 +809,12 @@ static bool do_descend(int argc, char *argv[])
 
     cnt = current->size;
     if (current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --cnt; cur_l = cur_l->next) {
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+        q_iter_t it;
+        element_t *item = q_iter_first(&it, current->q), *next_item;
+        for (; item && --cnt; item = next_item) {
+            next_item = q_iter_next(&it);
+            if (!next_item)
+                break;
             if (strcmp(item->value, next_item->value) < 0) {
                 report(1,
                        "ERROR: At least one node violated the ordering rule");
@@ -859,13 +872,16 @@ static bool do_merge(int argc, char *argv[])
     error_check();
 
     int len = 0;
+    /* The ring implementation allocates the array holding the result */
+#ifndef QUEUE_RING
     set_noallocate_mode(true);
+#endif
     if (current && exception_setup(true))
         len = q_merge(&chain.head, descend);
     exception_cancel();
     set_noallocate_mode(false);
 
-    if (q_size(&chain.head) > 1) {
+    if (chain.size > 1) {
         chain.size = 1;
         current = list_entry(chain.head.next, queue_contex_t, chain);
         current->size = len;
@@ -884,12 +900,13 @@ static bool do_merge(int argc, char *argv[])
 
     bool ok = true;
     if (current && current->size) {
-        for (struct list_head *cur_l = current->q->next;
-             cur_l != current->q && --len; cur_l = cur_l->next) {
+        q_iter_t it;
+        element_t *item = q_iter_first(&it, current->q), *next_item;
+        for (; item && --len; item = next_item) {
             /* Ensure each element in ascending order */
-            element_t *item, *next_item;
-            item = list_entry(cur_l, element_t, list);
-            next_item = list_entry(cur_l->next, element_t, list);
+            next_item = q_iter_next(&it);
+            if (!next_item)
+                break;
             if (!descend && strcmp(item->value, next_item->value) > 0) {
                 report(1,
                        "ERROR: Not sorted in ascending order (It might because "
@@ -915,33 +932,114 @@ static bool do_merge(int argc, char *argv[])
     q_show(3);
     return ok && !error_check();
 }
-/*
 static bool do_shuffle(int argc, char *argv[])
 {
     if (argc != 1) {
-        report(1, "%s takes too much arguments", argv[0]);
+        report(1, "%s takes no arguments", argv[0]);
         return false;
     }
 
     if (!current || !current->q) {
-        report(3, "Warning: Calling suffle on null queue");
+        report(3, "Warning: Calling shuffle on null queue");
         return false;
     }
     error_check();
 
-    set_noallocate_mode(true);
-    if (exception_setup(true)){
+    if (current && exception_setup(true)) {
         srand(os_random(getpid() ^ getppid()));
         q_shuffle(current->q);
     }
     exception_cancel();
 
-    set_noallocate_mode(false);
-
     q_show(3);
     return !error_check();
 }
-*/
+
+static bool do_stress(int argc, char *argv[])
+{
+    if (argc > 4) {
+        report(1, "%s takes at most three arguments", argv[0]);
+        return false;
+    }
+
+    int producers = 2, consumers = 2, ops = 100000;
+    int *args[] = {&producers, &consumers, &ops};
+    for (int i = 1; i < argc; i++) {
+        if (!get_int(argv[i], args[i - 1]) || *args[i - 1] < 1) {
+            report(1, "Invalid argument '%s'", argv[i]);
+            return false;
+        }
+    }
+    if (producers + consumers > LFQ_MAX_THREADS) {
+        report(1, "At most %d threads are supported", LFQ_MAX_THREADS);
+        return false;
+    }
+
+    /* Threads cannot be timed out, but the two-lock queue allocates through
+     * the harness, whose errors are checked afterwards.
+     */
+    error_check();
+    bool ok = stress_run(producers, consumers, ops, stress_two_lock);
+    return ok && !error_check();
+}
+
+static bool do_complexity(int argc, char *argv[])
+{
+    if (argc > 3) {
+        report(1, "%s takes at most two arguments", argv[0]);
+        return false;
+    }
+
+    const char *op = argc > 1 && strcmp(argv[1], "all") ? argv[1] : NULL;
+    int max_size = 16384;
+    if (argc > 2 && !get_int(argv[2], &max_size)) {
+        report(1, "Invalid maximum size '%s'", argv[2]);
+        return false;
+    }
+
+    /* The sweep takes longer than any single operation may */
+    error_check();
+    bool ok = false;
+    if (exception_setup(false))
+        ok = complexity_run(op, max_size);
+    exception_cancel();
+    return ok && !error_check();
+}
+
+static bool do_allocstats(int argc, char *argv[])
+{
+    if (argc > 3) {
+        report(1, "%s takes at most two arguments", argv[0]);
+        return false;
+    }
+
+    alloc_order_t order = ALLOC_BY_COUNT;
+    if (argc > 1) {
+        if (!strcmp(argv[1], "reset")) {
+            alloc_profile_reset();
+            return true;
+        }
+        if (!strcmp(argv[1], "bytes"))
+            order = ALLOC_BY_BYTES;
+        else if (!strcmp(argv[1], "peak"))
+            order = ALLOC_BY_PEAK;
+        else if (strcmp(argv[1], "count")) {
+            report(1, "Unknown order '%s'", argv[1]);
+            return false;
+        }
+    }
+
+    int n = 10;
+    if (argc > 2 && (!get_int(argv[2], &n) || n < 1)) {
+        report(1, "Invalid number of call sites '%s'", argv[2]);
+        return false;
+    }
+
+    if (!alloc_profile)
+        report(1, "Warning: Profiling is off, see option alloc_profile");
+    alloc_profile_report(order, n);
+    return true;
+}
 
 static bool is_circular()
 {
@@ -967,9 +1065,34 @@ static bool is_circular()
     return true;
 }
 
+/* Count the elements of the current queue by walking it, and compare the
+ * result with what q_size() reports.
+ */
+static bool check_size()
+{
+    if (!current || !current->q || !is_circular())
+        return true;
+
+    int cnt = 0;
+    q_iter_t it;
+    for (element_t *e = q_iter_first(&it, current->q); e; e = q_iter_next(&it))
+        cnt++;
+
+    int size = q_size(current->q);
+    if (size != cnt) {
+        report(1,
+               "ERROR: q_size() returned %d, but the queue holds %d elements",
+               size, cnt);
+        return false;
+    }
+    return true;
+}
+
 static bool q_show(int vlevel)
 {
     bool ok = true;
+    if (size_check && !check_size())
+        return false;
     if (verblevel < vlevel)
         return true;
 
@@ -986,12 +1109,12 @@ static bool q_show(int vlevel)
 
     report_noreturn(vlevel, "l = [");
 
-    struct list_head *ori = current->q;
-    struct list_head *cur = current->q->next;
+    q_iter_t it;
+    element_t *e = NULL;
 
     if (exception_setup(true)) {
-        while (ok && ori != cur && cnt < current->size) {
-            element_t *e = list_entry(cur, element_t, list);
+        e = q_iter_first(&it, current->q);
+        while (ok && e && cnt < current->size) {
             if (cnt < BIG_LIST_SIZE) {
                 report_noreturn(vlevel, cnt == 0 ? "%s" : " %s", e->value);
                 if (show_entropy) {
@@ -1001,7 +1124,7 @@ static bool q_show(int vlevel)
                 }
             }
             cnt++;
-            cur = cur->next;
+            e = q_iter_next(&it);
             ok = ok && !error_check();
         }
     }
@@ -1012,7 +1135,7 @@ static bool q_show(int vlevel)
         return false;
     }
 
-    if (cur == ori) {
+    if (!e) {
         if (cnt <= BIG_LIST_SIZE)
             report(vlevel, "]");
         else
@@ -1126,7 +1249,19 @@ static void console_init()
                 "");
     ADD_COMMAND(reverseK, "Reverse the nodes of the queue 'K' at a time",
                 "[K]");
-    // ADD_COMMAND(shuffle, "Shuffle the nodes in queue", "");
+    ADD_COMMAND(shuffle, "Shuffle the nodes in queue", "");
+    ADD_COMMAND(complexity,
+                "Fit the growth of the running time of operations with queue "
+                "size",
+                "[op|all] [max_size]");
+    ADD_COMMAND(allocstats,
+                "Show the top N call sites of the allocator by count, bytes "
+                "or peak live bytes, or reset the statistics",
+                "[count|bytes|peak|reset] [N]");
+    ADD_COMMAND(stress,
+                "Run producer and consumer threads on a concurrent queue, "
+                "and report throughput and latency",
+                "[producers] [consumers] [ops]");
     add_param("length", &string_length, "Maximum length of displayed string",
               NULL);
     add_param("malloc", &fail_probability, "Malloc failure probability percent",
@@ -1135,6 +1270,29 @@ static void console_init()
               "Number of times allow queue operations to return false", NULL);
     add_param("descend", &descend,
               "Sort and merge queue in ascending/descending order", NULL);
+    add_param("sort_threads", &q_sort_threads,
+              "Number of threads used to sort large queues", NULL);
+    add_param("size_check", &size_check,
+              "Verify the size kept by the queue against a walk of it", NULL);
+    add_param("dudect_threads", &dudect_threads,
+              "Number of threads measuring constant time in simulation mode",
+              NULL);
+    add_param("dudect_serialize", &dudect_serialize,
+              "Fence timestamps and pin threads and memory in constant time "
+              "tests",
+              NULL);
+    add_param("dudect_fpr", &dudect_fpr,
+              "False positive rate of constant time tests, per million", NULL);
+    add_param("dudect_leak", &dudect_leak,
+              "Largest leak constant time tests let through, as tau in "
+              "thousandths",
+              NULL);
+    add_param("fast", &fast_mode,
+              "Skip the bookkeeping of allocated blocks, for timing", NULL);
+    add_param("alloc_profile", &alloc_profile,
+              "Profile allocations by call site, see allocstats", NULL);
+    add_param("stress_two_lock", &stress_two_lock,
+              "Run the stress command on the two-lock queue", NULL);
 }
 
 /* Signal handlers */
@@ -1167,8 +1325,6 @@ static void q_init()
 static bool q_quit(int argc, char *argv[])
 {
     report(3, "Freeing queue");
-    if (current && current->size > BIG_LIST_SIZE)
-        set_cautious_mode(false);
 
     if (exception_setup(true)) {
         struct list_head *cur = chain.head.next;
@@ -1182,7 +1338,6 @@ static bool q_quit(int argc, char *argv[])
     }
 
     exception_cancel();
-    set_cautious_mode(true);
 
     size_t bcnt = allocation_check();
     if (bcnt > 0) {
@@ -2,29 +2,90 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "list_sort.h"
+#include "pool.h"
 #include "queue.h"
+#include "random.h"
+
+/* The list head handed out by q_new() is the first member of the queue, so
+ * the queue, its pool and its length can be recovered from it. Every q_*
+ * function adding or removing elements keeps size up to date.
+ */
+typedef struct {
+    struct list_head head;
+    size_t size;
+    pool_t pool;
+} queue_t;
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
 
 /* Create an empty queue */
 struct list_head *q_new()
 {
-    struct list_head *q = malloc(sizeof(struct list_head));
+    queue_t *q = malloc(sizeof(queue_t));
     // if (!q)
     //     return NULL;
     while (q == NULL)
-        q = malloc(sizeof(struct list_head));
-    INIT_LIST_HEAD(q);
-    return q;
+        q = malloc(sizeof(queue_t));
+    INIT_LIST_HEAD(&q->head);
+    q->size = 0;
+    pool_init(&q->pool);
+    return &q->head;
 }
 
 /* Free all storage used by queue */
 void q_free(struct list_head *head)
 {
-    element_t *entry = NULL, *safe;
-    list_for_each_entry_safe(entry, safe, head, list) {
-        q_release_element(entry);
-    }
-    free(head);
-    return;
+    if (!head)
+        return;
+
+    /* Every element lives in a slab of the pool, so there is no need to walk
+     * the list and release them one by one.
+     */
+    queue_t *q = to_queue(head);
+    pool_destroy(&q->pool);
+    free(q);
+}
+
+/* Walk the elements of queue from head to tail */
+element_t *q_iter_first(q_iter_t *it, struct list_head *head)
+{
+    it->head = head;
+    it->node = head;
+    return head ? q_iter_next(it) : NULL;
+}
+
+element_t *q_iter_next(q_iter_t *it)
+{
+    struct list_head *node = ((struct list_head *) it->node)->next;
+    if (node == it->head)
+        return NULL;
+    it->node = node;
+    return list_entry(node, element_t, list);
+}
+
+/* Return the element at head/tail of queue without removing it */
+element_t *q_peek_head(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return NULL;
+    return list_first_entry(head, element_t, list);
+}
+
+element_t *q_peek_tail(struct list_head *head)
+{
+    if (!head || list_empty(head))
+        return NULL;
+    return list_last_entry(head, element_t, list);
+}
+
+/* Release an element removed from its queue */
+void q_release_element(element_t *e)
+{
+    pool_free_element(e);
 }
 
 /* Insert an element at head of queue */
@@ -32,17 +93,11 @@ bool q_insert_head(struct list_head *head, char *s)
 {
     if (!head)
         return false;
-    element_t *element = malloc(sizeof(element_t));
+    element_t *element = pool_alloc_element(&to_queue(head)->pool, s);
     if (!element)
         return false;
-    struct list_head *node = &element->list;
-    INIT_LIST_HEAD(node);
-    element->value = strdup(s);
-    if (!element->value) {
-        q_release_element(element);
-        return false;
-    }
-    list_add(node, head);
+    list_add(&element->list, head);
+    to_queue(head)->size++;
     return true;
 }
 
@@ -51,17 +106,11 @@ bool q_insert_tail(struct list_head *head, char *s)
 {
     if (!head)
         return false;
-    element_t *element = malloc(sizeof(element_t));
+    element_t *element = pool_alloc_element(&to_queue(head)->pool, s);
     if (!element)
         return false;
-    struct list_head *node = &element->list;
-    INIT_LIST_HEAD(node);
-    element->value = strdup(s);
-    if (!element->value) {
-        q_release_element(element);
-        return false;
-    }
-    list_add_tail(node, head);
+    list_add_tail(&element->list, head);
+    to_queue(head)->size++;
     return true;
 }
 
@@ -72,9 +121,10 @@ element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
         return NULL;
     element_t *entry = list_first_entry(head, element_t, list);
     list_del(&entry->list);
+    to_queue(head)->size--;
     if (sp) {
         size_t dlen = strnlen(entry->value, bufsize - 1);
-        mempcpy(sp, entry->value, dlen);
+        memcpy(sp, entry->value, dlen);
         *(sp + dlen) = 0;
     }
     return entry;
@@ -87,9 +137,10 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
         return NULL;
     element_t *entry = list_last_entry(head, element_t, list);
     list_del(&entry->list);
+    to_queue(head)->size--;
     if (sp) {
         size_t dlen = strnlen(entry->value, bufsize - 1);
-        mempcpy(sp, entry->value, dlen);
+        memcpy(sp, entry->value, dlen);
         *(sp + dlen) = 0;
     }
     return entry;
@@ -101,12 +152,7 @@ int q_size(struct list_head *head)
     if (!head)
         return 0;
 
-    int len = 0;
-    struct list_head *li;
-
-    list_for_each(li, head)
-        len++;
-    return len;
+    return to_queue(head)->size;
 }
 
 /* Delete the middle node in queue */
@@ -122,8 +168,8 @@ bool q_delete_mid(struct list_head *head)
 
     element_t *entry = list_entry(*indir, element_t, list);
     list_del(*indir);
-    free(entry->value);
-    free(entry);
+    to_queue(head)->size--;
+    q_release_element(entry);
     return true;
 }
 
@@ -134,18 +180,22 @@ bool q_delete_dup(struct list_head *head)
         return false;
 
     bool dup = false;
+    size_t removed = 0;
     element_t *node, *safe;
     list_for_each_entry_safe(node, safe, head, list) {
-        if (&safe->list != head && !strcmp(node->value, safe->value)) {
+        if (&safe->list != head && !element_cmp(node, safe)) {
             list_del(&node->list);
             q_release_element(node);
+            removed++;
             dup = true;
         } else if (dup) {
             list_del(&node->list);
             q_release_element(node);
+            removed++;
             dup = false;
         }
     }
+    to_queue(head)->size -= removed;
     return true;
 }
 
@@ -198,98 +248,27 @@ void q_reverseK(struct list_head *head, int k)
         return;
 
     int times = q_size(head) / k;
-    struct list_head *tail = NULL;
-
-    LIST_HEAD(tmp);
-    LIST_HEAD(new_head);
+    struct list_head *before = head;
 
+    /* Swap next and prev of every node in the group while walking it, then
+     * hook the group back in between before and the node following it.
+     */
     for (int i = 0; i < times; i++) {
-        int j = 0;
-        list_for_each(tail, head) {
-            if (j >= k)
-                break;
-            j++;
-        }
-        list_cut_position(&tmp, head, tail->prev);
-        q_reverse(&tmp);
-        list_splice_tail(&tmp, &new_head);
-    }
-    list_splice(&new_head, head);
-}
-
-bool cmp(const struct list_head *a, const struct list_head *b, bool descend)
-{
-    element_t const *e1 = list_entry(a, element_t, list);
-    element_t const *e2 = list_entry(b, element_t, list);
-
-    if (descend)
-        return strcmp(e1->value, e2->value) >= 0;
-
-    return strcmp(e1->value, e2->value) <= 0;
-}
-
-struct list_head *merge(bool descend, struct list_head *a, struct list_head *b)
-{
-    struct list_head *head = NULL, **tail = &head;
-
-    for (;;) {
-        if (cmp(a, b, descend)) {
-            *tail = a;
-            tail = &a->next;
-            a = a->next;
-            if (!a) {
-                *tail = b;
-                break;
-            }
-        } else {
-            *tail = b;
-            tail = &b->next;
-            b = b->next;
-            if (!b) {
-                *tail = a;
-                break;
-            }
-        }
-    }
-    return head;
-}
-
-void merge_final(bool descend,
-                 struct list_head *head,
-                 struct list_head *a,
-                 struct list_head *b)
-{
-    struct list_head *tail = head;
-
-    for (;;) {
-        if (cmp(a, b, descend)) {
-            tail->next = a;
-            a->prev = tail;
-            tail = a;
-            a = a->next;
-            if (!a)
-                break;
-        } else {
-            tail->next = b;
-            b->prev = tail;
-            tail = b;
-            b = b->next;
-            if (!b) {
-                b = a;
-                break;
-            }
+        struct list_head *first = before->next, *prev = before, *node = first;
+
+        for (int j = 0; j < k; j++) {
+            struct list_head *next = node->next;
+            node->next = prev;
+            node->prev = next;
+            prev = node;
+            node = next;
         }
+        before->next = prev;
+        prev->prev = before;
+        first->next = node;
+        node->prev = first;
+        before = first;
     }
-
-    tail->next = b;
-    do {
-        b->prev = tail;
-        tail = b;
-        b = b->next;
-    } while (b);
-
-    tail->next = head;
-    head->prev = tail;
 }
 
 /* Sort elements of queue in ascending/descending order */
@@ -298,44 +277,7 @@ void q_sort(struct list_head *head, bool descend)
     if (!head || list_empty(head) || list_is_singular(head))
         return;
 
-    struct list_head *list = head->next, *pending = NULL;
-    size_t count = 0;
-
-    head->prev->next = NULL;
-
-    do {
-        size_t bits;
-        struct list_head **tail = &pending;
-
-        for (bits = count; bits & 1; bits >>= 1)
-            tail = &(*tail)->prev;
-
-        if (bits) {
-            struct list_head *a = *tail, *b = a->prev;
-
-            a = merge(descend, b, a);
-            a->prev = b->prev;
-            *tail = a;
-        }
-
-        list->prev = pending;
-        pending = list;
-        list = list->next;
-        pending->next = NULL;
-        count++;
-    } while (list);
-
-    list = pending;
-    pending = pending->prev;
-    for (;;) {
-        struct list_head *next = pending->prev;
-
-        if (!next)
-            break;
-        list = merge(descend, pending, list);
-        pending = next;
-    }
-    merge_final(descend, head, pending, list);
+    list_sort(head, descend, q_size(head));
 }
 
 /* Remove every node which has a node with a strictly less value anywhere to
@@ -356,6 +298,7 @@ int q_ascend(struct list_head *head)
             struct list_head *prev = left->prev;
             list_del(left);
             q_release_element(list_entry(left, element_t, list));
+            to_queue(head)->size--;
             left = prev;
         }
     }
@@ -380,79 +323,167 @@ int q_descend(struct list_head *head)
             struct list_head *prev = left->prev;
             list_del(left);
             q_release_element(list_entry(left, element_t, list));
+            to_queue(head)->size--;
             left = prev;
         }
     }
     return q_size(head);
 }
 
-int q_merge(struct list_head *head, bool descend)
+/* Number of queues q_merge() merges at once. Longer chains are merged in
+ * batches, each one folding the next queues into the first.
+ */
+#define MERGE_MAX_WAYS 256
+
+/* Position of q_merge() within one of its input queues */
+struct merge_cursor {
+    struct list_head *node, *head;
+    unsigned int idx;
+};
+
+/* Return true if the cursor a has to be emitted before b. Ties go to the
+ * queue coming first in the chain, which keeps the merge stable.
+ */
+static inline bool merge_before(const struct merge_cursor *a,
+                                const struct merge_cursor *b,
+                                bool descend)
 {
-    if (!head || list_empty(head) || list_is_singular(head))
-        return q_size(list_entry(head->next, queue_contex_t, chain)->q);
+    int c = element_cmp(list_entry(a->node, element_t, list),
+                        list_entry(b->node, element_t, list));
+    if (descend)
+        c = -c;
+    return c < 0 || (c == 0 && a->idx < b->idx);
+}
 
-    queue_contex_t *first = list_entry(head->next, queue_contex_t, chain);
-    struct list_head *first_q = first->q;
-    size_t size = first->size;
+static void merge_sift_down(struct merge_cursor *heap,
+                            int n,
+                            int i,
+                            bool descend)
+{
+    struct merge_cursor tmp = heap[i];
 
-    struct list_head *pos, *safe;
-    list_for_each_safe(pos, safe, head) {
-        if (pos == head->next)
-            continue;
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n &&
+            merge_before(&heap[child + 1], &heap[child], descend))
+            child++;
+        if (!merge_before(&heap[child], &tmp, descend))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = tmp;
+}
 
-        queue_contex_t *ctx = list_entry(pos, queue_contex_t, chain);
-        struct list_head *current_queue = ctx->q;
+/* Merge the n sorted queues of heap, which are in chain order, into out
+ * through a binary min-heap, leaving every input queue empty.
+ */
+static void merge_heap(struct merge_cursor *heap,
+                       int n,
+                       struct list_head *out,
+                       bool descend)
+{
+    for (int i = 0; i < n; i++) {
+        heap[i].node = heap[i].head->next;
+        heap[i].idx = i;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+        merge_sift_down(heap, n, i, descend);
 
-        if (!list_empty(current_queue)) {
-            list_splice_tail_init(current_queue, first_q);
-            size += ctx->size;
-            ctx->size = 0;
+    while (n > 1) {
+        struct list_head *node = heap[0].node;
+
+        heap[0].node = node->next;
+        if (heap[0].node == heap[0].head) {
+            INIT_LIST_HEAD(heap[0].head);
+            heap[0] = heap[--n];
         }
+        list_add_tail(node, out);
+        merge_sift_down(heap, n, 0, descend);
     }
-    q_sort(first_q, descend);
-    first->size = size;
-    return size;
-}
 
+    /* What is left of the last queue follows as a whole */
+    struct list_head *first = heap[0].node, *last = heap[0].head->prev;
+    first->prev = out->prev;
+    out->prev->next = first;
+    last->next = out;
+    out->prev = last;
+    INIT_LIST_HEAD(heap[0].head);
+}
 
-static inline void replace(struct list_head *old, struct list_head *new)
+int q_merge(struct list_head *head, bool descend)
 {
-    new->next = old->next;
-    new->prev = old->prev;
-    new->next->prev = new;
-    new->prev->next = new;
-}
+    if (!head || list_empty(head) || list_is_singular(head))
+        return q_size(list_entry(head->next, queue_contex_t, chain)->q);
 
+    queue_contex_t *first = list_entry(head->next, queue_contex_t, chain);
+    struct list_head *first_q = first->q;
 
-static inline void swap(struct list_head *a, struct list_head *b)
-{
-    struct list_head *pos = b->prev;
+    struct merge_cursor heap[MERGE_MAX_WAYS];
+    struct list_head *pos = head->next->next;
+    while (pos != head) {
+        int n = 0;
+
+        if (!list_empty(first_q))
+            heap[n++].head = first_q;
+        for (; pos != head && n < MERGE_MAX_WAYS; pos = pos->next) {
+            queue_contex_t *ctx = list_entry(pos, queue_contex_t, chain);
+
+            /* Elements moving to the first queue take their slabs along */
+            pool_adopt(&to_queue(first_q)->pool, &to_queue(ctx->q)->pool);
+            if (!list_empty(ctx->q)) {
+                heap[n++].head = ctx->q;
+                to_queue(first_q)->size += to_queue(ctx->q)->size;
+                to_queue(ctx->q)->size = 0;
+                ctx->size = 0;
+            }
+        }
 
-    list_del(b);
-    replace(a, b);
-    if (pos == a)
-        pos = b;
-    list_add(a, pos);
+        if (n) {
+            LIST_HEAD(out);
+            merge_heap(heap, n, &out, descend);
+            list_splice(&out, first_q);
+        }
+    }
+    first->size = q_size(first_q);
+    return first->size;
 }
 
-/* Fisher-Yates shuffle Algorithm */
+/* Fisher-Yates shuffle Algorithm, run over an index of the nodes */
 void q_shuffle(struct list_head *head)
 {
     if (!head || list_empty(head) || list_is_singular(head))
         return;
 
     size_t len = q_size(head);
-    struct list_head *pos, *temp;
-
-    for (pos = head->prev, temp = pos->prev; pos != head && len;
-         pos = temp, temp = pos->prev, len--) {
-        struct list_head *pick = head->prev;
-        for (int r = rand() % len; r > 0; r--)
-            pick = pick->prev;
+    struct list_head **nodes = malloc(len * sizeof(*nodes));
+    if (!nodes)
+        return;
 
-        if (pick == pos)
-            continue;
+    struct list_head *pos;
+    size_t i = 0;
+    list_for_each(pos, head)
+        nodes[i++] = pos;
+
+    /* Seeded from rand(), so that srand() still decides the outcome */
+    uint64_t state = (uint64_t) rand() << 32 ^ (uint64_t) rand();
+    for (i = len - 1; i > 0; i--) {
+        size_t j = random_bounded(&state, i + 1);
+        struct list_head *tmp = nodes[i];
+        nodes[i] = nodes[j];
+        nodes[j] = tmp;
+    }
 
-        swap(pos, pick);
+    struct list_head *prev = head;
+    for (i = 0; i < len; i++) {
+        prev->next = nodes[i];
+        nodes[i]->prev = prev;
+        prev = nodes[i];
     }
-}
\ No newline at end of file
+    prev->next = head;
+    head->prev = prev;
+
+    free(nodes);
+}
@@ -4,25 +4,46 @@
 /* This program implements a queue supporting both FIFO and LIFO
  * operations.
  *
- * It uses a circular doubly-linked list to represent the set of queue elements
+ * queue.c uses a circular doubly-linked list to represent the set of queue
+ * elements, queue_ring.c a circular array of pointers to them, and
+ * queue_unrolled.c a list of fixed-size arrays of such pointers. The Makefile
+ * variable QUEUE selects which one is built.
  */
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 #include "harness.h"
 #include "list.h"
 
+/* Strings of up to this many bytes, including the terminating null byte, are
+ * kept inside the element itself rather than in a separate allocation.
+ */
+#define Q_INLINE_SIZE 16
+
+struct pool_slab;
+
 /**
  * element_t - Linked list element
  * @value: pointer to array holding string
  * @list: node of a doubly-linked list
- *
- * @value needs to be explicitly allocated and freed
+ * @key: first 8 bytes of the string packed big-endian, zero padded
+ * @slab: slab of the queue's pool the element was carved from
+ * @inline_value: in-place storage for short strings
+ *
+ * @value points either to @inline_value or, for strings that do not fit, to a
+ * copy kept in the same pool as the element. Both are owned by the pool and
+ * must only be given back through q_release_element(). Comparing @key values
+ * gives the same order as strcmp() on the strings, up to ties between strings
+ * sharing their first 8 bytes.
  */
 typedef struct {
     char *value;
     struct list_head list;
+    uint64_t key;
+    struct pool_slab *slab;
+    char inline_value[Q_INLINE_SIZE];
 } element_t;
 
 /**
@@ -89,7 +110,8 @@ bool q_insert_tail(struct list_head *head, char *s);
  *
  * NOTE: "remove" is different from "delete"
  * The space used by the list element and the string should not be freed.
- * The only thing "remove" need to do is unlink it.
+ * The only thing "remove" need to do is unlink it. The element still belongs
+ * to the queue's pool and must be released before the queue is freed.
  *
  * Reference:
  * https://english.stackexchange.com/questions/52508/difference-between-delete-and-remove
@@ -112,13 +134,10 @@ element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize);
  * q_release_element() - Release the element
  * @e: element would be released
  *
+ * The element is handed back to the pool it was carved from for reuse.
  * This function is intended for internal use only.
  */
-static inline void q_release_element(element_t *e)
-{
-    test_free(e->value);
-    test_free(e);
-}
+void q_release_element(element_t *e);
 
 /**
  * q_size() - Get the size of the queue
@@ -200,6 +219,11 @@ void q_reverseK(struct list_head *head, int k);
  */
 void q_sort(struct list_head *head, bool descend);
 
+/* Number of threads q_sort() may spread a large queue over, 1 to sort on the
+ * calling thread only. Sorting in parallel is just as stable.
+ */
+extern int q_sort_threads;
+
 /**
  * q_ascend() - Delete every node which has a node with a strictly less
  * value anywhere to the right side of it.
@@ -239,7 +263,8 @@ int q_descend(struct list_head *head);
  * This function merge the second to the last queues in the chain into the first
  * queue. The queues are guaranteed to be sorted before this function is called.
  * No effect if there is only one queue in the chain. Allocation is disallowed
- * in this function. There is no need to free the 'queue_contex_t' and its
+ * in this function, except in the ring implementation which needs a larger
+ * array for the result. There is no need to free the 'queue_contex_t' and its
  * member 'q' since they will be released externally. However, q_merge() is
  * responsible for making the queues to be NULL-queue, except the first one.
  *
@@ -250,4 +275,69 @@ int q_descend(struct list_head *head);
  */
 int q_merge(struct list_head *head, bool descend);
 
+/**
+ * q_shuffle() - Shuffle the nodes of the queue
+ * @head: header of queue
+ *
+ * Every permutation is equally likely. The random numbers are seeded from
+ * rand(), so the caller decides the outcome through srand(). No effect if
+ * queue is NULL, empty, or if memory for the index of nodes cannot be
+ * allocated.
+ *
+ * Reference:
+ * https://en.wikipedia.org/wiki/Fisher%E2%80%93Yates_shuffle
+ */
+void q_shuffle(struct list_head *head);
+
+/**
+ * q_iter_t - Position within a queue being walked
+ * @head: header of queue
+ * @node: node holding the element last returned, if any
+ * @idx: index of the element last returned within @node or within the queue
+ *
+ * How @node and @idx are used depends on the implementation of the queue.
+ */
+typedef struct {
+    struct list_head *head;
+    void *node;
+    size_t idx;
+} q_iter_t;
+
+/**
+ * q_iter_first() - Start walking a queue from head to tail
+ * @it: iterator to set up
+ * @head: header of queue
+ *
+ * The queue must not be modified until the walk is over. Code outside of the
+ * queue implementation should walk queues this way rather than follow the
+ * links of the elements, which not every implementation maintains.
+ *
+ * Return: the element at head, NULL if queue is NULL or empty
+ */
+element_t *q_iter_first(q_iter_t *it, struct list_head *head);
+
+/**
+ * q_iter_next() - Move on to the next element of the walk
+ * @it: iterator set up by q_iter_first()
+ *
+ * Return: the element following the one last returned, NULL past the tail
+ */
+element_t *q_iter_next(q_iter_t *it);
+
+/**
+ * q_peek_head() - Get the element at head of queue without removing it
+ * @head: header of queue
+ *
+ * Return: the element, NULL if queue is NULL or empty
+ */
+element_t *q_peek_head(struct list_head *head);
+
+/**
+ * q_peek_tail() - Get the element at tail of queue without removing it
+ * @head: header of queue
+ *
+ * Return: the element, NULL if queue is NULL or empty
+ */
+element_t *q_peek_tail(struct list_head *head);
+
 #endif /* LAB0_QUEUE_H */
@@ -0,0 +1,520 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "list_sort.h"
+#include "pool.h"
+#include "queue.h"
+#include "random.h"
+
+/* Number of slots of a new queue. They are allocated upfront, like the first
+ * slab of the pool, so that the first insertions are as cheap as any other.
+ */
+#define RING_MIN 64
+
+/* The list head handed out by q_new() is the first member of the queue, so
+ * the queue can be recovered from it, but no element is ever linked to it.
+ * The elements are kept in slots, a circular array whose capacity is a power
+ * of two, the one at head of queue being at index first.
+ */
+typedef struct {
+    struct list_head head;
+    element_t **slots;
+    size_t cap;
+    size_t first;
+    size_t size;
+    pool_t pool;
+} queue_t;
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+/* Return the slot holding the i-th element of the queue */
+static inline element_t **ring_at(queue_t *q, size_t i)
+{
+    return &q->slots[(q->first + i) & (q->cap - 1)];
+}
+
+/* Move the elements into a new array of cap slots, starting at index 0 */
+static bool ring_resize(queue_t *q, size_t cap)
+{
+    element_t **slots = malloc(cap * sizeof(*slots));
+    if (!slots)
+        return false;
+
+    if (q->size) {
+        size_t n = q->cap - q->first;
+        if (n > q->size)
+            n = q->size;
+        memcpy(slots, q->slots + q->first, n * sizeof(*slots));
+        memcpy(slots + n, q->slots, (q->size - n) * sizeof(*slots));
+    }
+    if (q->slots)
+        free(q->slots);
+    q->slots = slots;
+    q->cap = cap;
+    q->first = 0;
+    return true;
+}
+
+/* Make room for one more element, doubling the capacity if needed */
+static inline bool ring_reserve(queue_t *q)
+{
+    if (q->size < q->cap)
+        return true;
+    return ring_resize(q, q->cap ? q->cap << 1 : RING_MIN);
+}
+
+/* Reverse the order of the elements from index i to index j */
+static void ring_reverse(queue_t *q, size_t i, size_t j)
+{
+    for (; i < j; i++, j--) {
+        element_t **a = ring_at(q, i), **b = ring_at(q, j);
+        element_t *tmp = *a;
+        *a = *b;
+        *b = tmp;
+    }
+}
+
+/* Create an empty queue */
+struct list_head *q_new()
+{
+    queue_t *q = malloc(sizeof(queue_t));
+    while (q == NULL)
+        q = malloc(sizeof(queue_t));
+    INIT_LIST_HEAD(&q->head);
+    q->slots = NULL;
+    q->cap = 0;
+    q->first = 0;
+    q->size = 0;
+
+    /* Failing here is harmless, the slots are allocated on demand */
+    ring_resize(q, RING_MIN);
+    pool_init(&q->pool);
+    return &q->head;
+}
+
+/* Free all storage used by queue */
+void q_free(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_t *q = to_queue(head);
+    pool_destroy(&q->pool);
+    if (q->slots)
+        free(q->slots);
+    free(q);
+}
+
+/* Walk the elements of queue from head to tail */
+element_t *q_iter_first(q_iter_t *it, struct list_head *head)
+{
+    it->head = head;
+    it->idx = (size_t) -1;
+    return head ? q_iter_next(it) : NULL;
+}
+
+element_t *q_iter_next(q_iter_t *it)
+{
+    queue_t *q = to_queue(it->head);
+    if (it->idx + 1 >= q->size)
+        return NULL;
+    return *ring_at(q, ++it->idx);
+}
+
+/* Return the element at head/tail of queue without removing it */
+element_t *q_peek_head(struct list_head *head)
+{
+    if (!head || !to_queue(head)->size)
+        return NULL;
+    return *ring_at(to_queue(head), 0);
+}
+
+element_t *q_peek_tail(struct list_head *head)
+{
+    if (!head || !to_queue(head)->size)
+        return NULL;
+    return *ring_at(to_queue(head), to_queue(head)->size - 1);
+}
+
+/* Release an element removed from its queue */
+void q_release_element(element_t *e)
+{
+    pool_free_element(e);
+}
+
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q))
+        return false;
+    element_t *element = pool_alloc_element(&q->pool, s);
+    if (!element)
+        return false;
+    q->first = (q->first - 1) & (q->cap - 1);
+    q->slots[q->first] = element;
+    q->size++;
+    return true;
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+    queue_t *q = to_queue(head);
+    if (!ring_reserve(q))
+        return false;
+    element_t *element = pool_alloc_element(&q->pool, s);
+    if (!element)
+        return false;
+    *ring_at(q, q->size) = element;
+    q->size++;
+    return true;
+}
+
+/* Copy the string of a removed element to sp, if not NULL */
+static void copy_value(char *sp, size_t bufsize, const element_t *entry)
+{
+    if (sp) {
+        size_t dlen = strnlen(entry->value, bufsize - 1);
+        memcpy(sp, entry->value, dlen);
+        *(sp + dlen) = 0;
+    }
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || !to_queue(head)->size)
+        return NULL;
+    queue_t *q = to_queue(head);
+    element_t *entry = q->slots[q->first];
+    q->first = (q->first + 1) & (q->cap - 1);
+    q->size--;
+    copy_value(sp, bufsize, entry);
+    return entry;
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || !to_queue(head)->size)
+        return NULL;
+    queue_t *q = to_queue(head);
+    element_t *entry = *ring_at(q, q->size - 1);
+    q->size--;
+    copy_value(sp, bufsize, entry);
+    return entry;
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (!head)
+        return 0;
+
+    return to_queue(head)->size;
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    if (!head || !to_queue(head)->size)
+        return false;
+
+    /* No more elements follow the middle one than precede it, so the gap is
+     * closed from the tail side.
+     */
+    queue_t *q = to_queue(head);
+    size_t mid = q->size / 2;
+    element_t *entry = *ring_at(q, mid);
+    for (size_t i = mid; i + 1 < q->size; i++)
+        *ring_at(q, i) = *ring_at(q, i + 1);
+    q->size--;
+    q_release_element(entry);
+    return true;
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    if (!head || !to_queue(head)->size)
+        return false;
+
+    queue_t *q = to_queue(head);
+    bool dup = false;
+    size_t kept = 0;
+    for (size_t i = 0; i < q->size; i++) {
+        element_t *node = *ring_at(q, i);
+        if (i + 1 < q->size && !element_cmp(node, *ring_at(q, i + 1))) {
+            q_release_element(node);
+            dup = true;
+        } else if (dup) {
+            q_release_element(node);
+            dup = false;
+        } else {
+            *ring_at(q, kept++) = node;
+        }
+    }
+    q->size = kept;
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_t *q = to_queue(head);
+    for (size_t i = 0; i + 1 < q->size; i += 2)
+        ring_reverse(q, i, i + 1);
+}
+
+/* Reverse elements in queue */
+void q_reverse(struct list_head *head)
+{
+    if (!head || to_queue(head)->size < 2)
+        return;
+
+    ring_reverse(to_queue(head), 0, to_queue(head)->size - 1);
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    if (!head || q_size(head) < 2 || k <= 1 || k > q_size(head))
+        return;
+
+    queue_t *q = to_queue(head);
+    size_t times = q->size / k;
+    for (size_t i = 0; i < times; i++)
+        ring_reverse(q, i * k, i * k + k - 1);
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (!head || to_queue(head)->size < 2)
+        return;
+
+    /* Thread the elements through their list nodes, which are otherwise
+     * unused, sort them as a list and store them back in order.
+     */
+    queue_t *q = to_queue(head);
+    LIST_HEAD(list);
+    for (size_t i = 0; i < q->size; i++)
+        list_add_tail(&(*ring_at(q, i))->list, &list);
+
+    list_sort(&list, descend, q->size);
+
+    element_t *entry;
+    size_t i = 0;
+    list_for_each_entry(entry, &list, list)
+        q->slots[i++] = entry;
+    q->first = 0;
+}
+
+/* Keep the elements no element to their right sorts strictly before, in the
+ * requested order, and release the others.
+ */
+static int ring_monotonic(struct list_head *head, bool descend)
+{
+    if (!head || !to_queue(head)->size)
+        return 0;
+
+    /* Kept elements are packed towards the tail, the leftmost at index kept */
+    queue_t *q = to_queue(head);
+    size_t kept = q->size - 1;
+    for (size_t i = kept; i-- > 0;) {
+        element_t *entry = *ring_at(q, i);
+        int c = element_cmp(entry, *ring_at(q, kept));
+        if (descend ? c >= 0 : c <= 0)
+            *ring_at(q, --kept) = entry;
+        else
+            q_release_element(entry);
+    }
+    q->first = (q->first + kept) & (q->cap - 1);
+    q->size -= kept;
+    return q->size;
+}
+
+/* Remove every node which has a node with a strictly less value anywhere to
+ * the right side of it */
+int q_ascend(struct list_head *head)
+{
+    return ring_monotonic(head, false);
+}
+
+/* Remove every node which has a node with a strictly greater value anywhere to
+ * the right side of it */
+int q_descend(struct list_head *head)
+{
+    return ring_monotonic(head, true);
+}
+
+/* Number of queues q_merge() merges at once. Longer chains are merged in
+ * batches, each one folding the next queues into the first.
+ */
+#define MERGE_MAX_WAYS 256
+
+/* Position of q_merge() within one of its input queues */
+struct merge_cursor {
+    queue_t *q;
+    size_t pos;
+    unsigned int idx;
+};
+
+/* Return true if the cursor a has to be emitted before b. Ties go to the
+ * queue coming first in the chain, which keeps the merge stable.
+ */
+static inline bool merge_before(const struct merge_cursor *a,
+                                const struct merge_cursor *b,
+                                bool descend)
+{
+    int c = element_cmp(*ring_at(a->q, a->pos), *ring_at(b->q, b->pos));
+    if (descend)
+        c = -c;
+    return c < 0 || (c == 0 && a->idx < b->idx);
+}
+
+static void merge_sift_down(struct merge_cursor *heap,
+                            int n,
+                            int i,
+                            bool descend)
+{
+    struct merge_cursor tmp = heap[i];
+
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n &&
+            merge_before(&heap[child + 1], &heap[child], descend))
+            child++;
+        if (!merge_before(&heap[child], &tmp, descend))
+            break;
+        heap[i] = heap[child];
+        i = child;
+    }
+    heap[i] = tmp;
+}
+
+/* Merge the n non-empty sorted queues of heap, which are in chain order, into
+ * out through a binary min-heap, leaving every input queue empty.
+ */
+static void merge_heap(struct merge_cursor *heap,
+                       int n,
+                       element_t **out,
+                       bool descend)
+{
+    for (int i = 0; i < n; i++) {
+        heap[i].pos = 0;
+        heap[i].idx = i;
+    }
+    for (int i = n / 2 - 1; i >= 0; i--)
+        merge_sift_down(heap, n, i, descend);
+
+    while (n > 1) {
+        *out++ = *ring_at(heap[0].q, heap[0].pos++);
+        if (heap[0].pos == heap[0].q->size) {
+            heap[0].q->size = 0;
+            heap[0] = heap[--n];
+        }
+        merge_sift_down(heap, n, 0, descend);
+    }
+
+    /* What is left of the last queue follows as a whole */
+    while (heap[0].pos < heap[0].q->size)
+        *out++ = *ring_at(heap[0].q, heap[0].pos++);
+    heap[0].q->size = 0;
+}
+
+/* Unlike the list implementation, this one allocates the array holding the
+ * merged queue. Should that fail, the queues left are not merged.
+ */
+int q_merge(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return q_size(list_entry(head->next, queue_contex_t, chain)->q);
+
+    queue_contex_t *first = list_entry(head->next, queue_contex_t, chain);
+    queue_t *first_q = to_queue(first->q);
+
+    struct merge_cursor heap[MERGE_MAX_WAYS];
+    struct list_head *pos = head->next->next;
+    while (pos != head) {
+        struct list_head *end = pos;
+        size_t size = first_q->size;
+        int n = size ? 1 : 0;
+
+        for (; end != head && n < MERGE_MAX_WAYS; end = end->next) {
+            queue_contex_t *ctx = list_entry(end, queue_contex_t, chain);
+            if (to_queue(ctx->q)->size) {
+                size += to_queue(ctx->q)->size;
+                n++;
+            }
+        }
+
+        /* Nothing to merge if the other queues are all empty */
+        bool grow = size > first_q->size;
+        size_t cap = RING_MIN;
+        while (cap < size)
+            cap <<= 1;
+        element_t **slots = NULL;
+        if (grow && !(slots = malloc(cap * sizeof(*slots))))
+            break;
+
+        n = 0;
+        if (first_q->size)
+            heap[n++].q = first_q;
+        for (; pos != end; pos = pos->next) {
+            queue_contex_t *ctx = list_entry(pos, queue_contex_t, chain);
+            queue_t *q = to_queue(ctx->q);
+
+            /* Elements moving to the first queue take their slabs along */
+            pool_adopt(&first_q->pool, &q->pool);
+            if (q->size)
+                heap[n++].q = q;
+            ctx->size = 0;
+        }
+
+        if (grow) {
+            merge_heap(heap, n, slots, descend);
+            if (first_q->slots)
+                free(first_q->slots);
+            first_q->slots = slots;
+            first_q->cap = cap;
+            first_q->first = 0;
+            first_q->size = size;
+        }
+    }
+    first->size = q_size(first->q);
+    return first->size;
+}
+
+/* Fisher-Yates shuffle Algorithm */
+void q_shuffle(struct list_head *head)
+{
+    if (!head || to_queue(head)->size < 2)
+        return;
+
+    queue_t *q = to_queue(head);
+
+    /* Seeded from rand(), so that srand() still decides the outcome */
+    uint64_t state = (uint64_t) rand() << 32 ^ (uint64_t) rand();
+    for (size_t i = q->size - 1; i > 0; i--) {
+        element_t **a = ring_at(q, i);
+        element_t **b = ring_at(q, random_bounded(&state, i + 1));
+        element_t *tmp = *a;
+        *a = *b;
+        *b = tmp;
+    }
+}
@@ -0,0 +1,606 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "list_sort.h"
+#include "pool.h"
+#include "queue.h"
+#include "random.h"
+
+/* Number of element pointers held by each chunk */
+#define CHUNK_SLOTS 64
+
+/**
+ * struct chunk - Node of the unrolled list
+ * @list: node in the list of chunks of the queue
+ * @begin: index of the first slot in use
+ * @end: index past the last slot in use
+ * @slots: pointers to the elements, in queue order
+ *
+ * Chunks linked to the queue always hold at least one element. Emptied ones
+ * are kept aside for reuse, their memory belongs to the pool of the queue.
+ */
+struct chunk {
+    struct list_head list;
+    unsigned int begin, end;
+    element_t *slots[CHUNK_SLOTS];
+};
+
+/* The list head handed out by q_new() is the first member of the queue, so
+ * the queue can be recovered from it, but no element is ever linked to it.
+ */
+typedef struct {
+    struct list_head head;
+    struct list_head chunks;
+    struct list_head spare;
+    size_t size;
+    pool_t pool;
+} queue_t;
+
+static inline queue_t *to_queue(struct list_head *head)
+{
+    return container_of(head, queue_t, head);
+}
+
+static inline struct chunk *chunk_of(struct list_head *node)
+{
+    return list_entry(node, struct chunk, list);
+}
+
+/* Position of an element: slot i of chunk c */
+struct cursor {
+    struct chunk *c;
+    unsigned int i;
+};
+
+/* Move the cursor m elements forward, or up to the end of the last chunk */
+static void cursor_advance(queue_t *q, struct cursor *cur, size_t m)
+{
+    while (m >= cur->c->end - cur->i && cur->c->list.next != &q->chunks) {
+        m -= cur->c->end - cur->i;
+        cur->c = chunk_of(cur->c->list.next);
+        cur->i = cur->c->begin;
+    }
+    cur->i += m;
+}
+
+/* Move the cursor one element backward */
+static inline void cursor_prev(struct cursor *cur)
+{
+    if (cur->i == cur->c->begin) {
+        cur->c = chunk_of(cur->c->list.prev);
+        cur->i = cur->c->end;
+    }
+    cur->i--;
+}
+
+/* Get an empty chunk, whose slots from index at on are meant to be filled */
+static struct chunk *chunk_new(queue_t *q, unsigned int at)
+{
+    struct chunk *c;
+    if (!list_empty(&q->spare)) {
+        c = chunk_of(q->spare.next);
+        list_del(&c->list);
+    } else {
+        c = pool_alloc(&q->pool, sizeof(struct chunk));
+        if (!c)
+            return NULL;
+    }
+    c->begin = c->end = at;
+    return c;
+}
+
+/* Set a chunk aside once it is emptied */
+static inline void chunk_retire(queue_t *q, struct chunk *c)
+{
+    list_move(&c->list, &q->spare);
+}
+
+/* Keep the elements before the cursor and drop the other ones, which must
+ * have been released or moved already.
+ */
+static void chunks_cut_after(queue_t *q, struct cursor cur)
+{
+    while (cur.c->list.next != &q->chunks)
+        chunk_retire(q, chunk_of(cur.c->list.next));
+    cur.c->end = cur.i;
+    if (cur.c->begin == cur.c->end)
+        chunk_retire(q, cur.c);
+}
+
+/* Keep the elements from the cursor on and drop the other ones, which must
+ * have been released or moved already.
+ */
+static void chunks_cut_before(queue_t *q, struct cursor cur)
+{
+    while (cur.c->list.prev != &q->chunks)
+        chunk_retire(q, chunk_of(cur.c->list.prev));
+    cur.c->begin = cur.i;
+    if (cur.c->begin == cur.c->end)
+        chunk_retire(q, cur.c);
+}
+
+/* Create an empty queue */
+struct list_head *q_new()
+{
+    queue_t *q = malloc(sizeof(queue_t));
+    while (q == NULL)
+        q = malloc(sizeof(queue_t));
+    INIT_LIST_HEAD(&q->head);
+    INIT_LIST_HEAD(&q->chunks);
+    INIT_LIST_HEAD(&q->spare);
+    q->size = 0;
+    pool_init(&q->pool);
+    return &q->head;
+}
+
+/* Free all storage used by queue */
+void q_free(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    /* Chunks live in the pool along with the elements */
+    queue_t *q = to_queue(head);
+    pool_destroy(&q->pool);
+    free(q);
+}
+
+/* Walk the elements of queue from head to tail */
+element_t *q_iter_first(q_iter_t *it, struct list_head *head)
+{
+    it->head = head;
+    it->node = NULL;
+    if (!head || !to_queue(head)->size)
+        return NULL;
+
+    struct chunk *c = chunk_of(to_queue(head)->chunks.next);
+    it->node = c;
+    it->idx = c->begin;
+    return c->slots[c->begin];
+}
+
+element_t *q_iter_next(q_iter_t *it)
+{
+    struct chunk *c = it->node;
+    if (!c)
+        return NULL;
+
+    if (it->idx + 1 == c->end) {
+        if (c->list.next == &to_queue(it->head)->chunks)
+            return NULL;
+        c = chunk_of(c->list.next);
+        it->node = c;
+        it->idx = c->begin;
+    } else {
+        it->idx++;
+    }
+    return c->slots[it->idx];
+}
+
+/* Return the element at head/tail of queue without removing it */
+element_t *q_peek_head(struct list_head *head)
+{
+    if (!head || !to_queue(head)->size)
+        return NULL;
+    struct chunk *c = chunk_of(to_queue(head)->chunks.next);
+    return c->slots[c->begin];
+}
+
+element_t *q_peek_tail(struct list_head *head)
+{
+    if (!head || !to_queue(head)->size)
+        return NULL;
+    struct chunk *c = chunk_of(to_queue(head)->chunks.prev);
+    return c->slots[c->end - 1];
+}
+
+/* Release an element removed from its queue */
+void q_release_element(element_t *e)
+{
+    pool_free_element(e);
+}
+
+/* Insert an element at head of queue */
+bool q_insert_head(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+
+    /* A chunk started empty gets filled from its middle, so that it has room
+     * on both sides, otherwise from the side facing the queue it extends.
+     */
+    queue_t *q = to_queue(head);
+    struct chunk *c = q->size ? chunk_of(q->chunks.next) : NULL;
+    if (!c || !c->begin) {
+        c = chunk_new(q, q->size ? CHUNK_SLOTS : CHUNK_SLOTS / 2);
+        if (!c)
+            return false;
+        list_add(&c->list, &q->chunks);
+    }
+
+    element_t *element = pool_alloc_element(&q->pool, s);
+    if (!element) {
+        if (c->begin == c->end)
+            chunk_retire(q, c);
+        return false;
+    }
+    c->slots[--c->begin] = element;
+    q->size++;
+    return true;
+}
+
+/* Insert an element at tail of queue */
+bool q_insert_tail(struct list_head *head, char *s)
+{
+    if (!head)
+        return false;
+
+    queue_t *q = to_queue(head);
+    struct chunk *c = q->size ? chunk_of(q->chunks.prev) : NULL;
+    if (!c || c->end == CHUNK_SLOTS) {
+        c = chunk_new(q, q->size ? 0 : CHUNK_SLOTS / 2);
+        if (!c)
+            return false;
+        list_add_tail(&c->list, &q->chunks);
+    }
+
+    element_t *element = pool_alloc_element(&q->pool, s);
+    if (!element) {
+        if (c->begin == c->end)
+            chunk_retire(q, c);
+        return false;
+    }
+    c->slots[c->end++] = element;
+    q->size++;
+    return true;
+}
+
+/* Copy the string of a removed element to sp, if not NULL */
+static void copy_value(char *sp, size_t bufsize, const element_t *entry)
+{
+    if (sp) {
+        size_t dlen = strnlen(entry->value, bufsize - 1);
+        memcpy(sp, entry->value, dlen);
+        *(sp + dlen) = 0;
+    }
+}
+
+/* Remove an element from head of queue */
+element_t *q_remove_head(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || !to_queue(head)->size)
+        return NULL;
+    queue_t *q = to_queue(head);
+    struct chunk *c = chunk_of(q->chunks.next);
+    element_t *entry = c->slots[c->begin++];
+    if (c->begin == c->end)
+        chunk_retire(q, c);
+    q->size--;
+    copy_value(sp, bufsize, entry);
+    return entry;
+}
+
+/* Remove an element from tail of queue */
+element_t *q_remove_tail(struct list_head *head, char *sp, size_t bufsize)
+{
+    if (!head || !to_queue(head)->size)
+        return NULL;
+    queue_t *q = to_queue(head);
+    struct chunk *c = chunk_of(q->chunks.prev);
+    element_t *entry = c->slots[--c->end];
+    if (c->begin == c->end)
+        chunk_retire(q, c);
+    q->size--;
+    copy_value(sp, bufsize, entry);
+    return entry;
+}
+
+/* Return number of elements in queue */
+int q_size(struct list_head *head)
+{
+    if (!head)
+        return 0;
+
+    return to_queue(head)->size;
+}
+
+/* Delete the middle node in queue */
+bool q_delete_mid(struct list_head *head)
+{
+    if (!head || !to_queue(head)->size)
+        return false;
+
+    queue_t *q = to_queue(head);
+    struct cursor cur = {chunk_of(q->chunks.next), 0};
+    cur.i = cur.c->begin;
+    cursor_advance(q, &cur, q->size / 2);
+
+    /* Close the gap within the chunk only */
+    struct chunk *c = cur.c;
+    element_t *entry = c->slots[cur.i];
+    memmove(&c->slots[cur.i], &c->slots[cur.i + 1],
+            (c->end - cur.i - 1) * sizeof(c->slots[0]));
+    if (--c->end == c->begin)
+        chunk_retire(q, c);
+    q->size--;
+    q_release_element(entry);
+    return true;
+}
+
+/* Delete all nodes that have duplicate string */
+bool q_delete_dup(struct list_head *head)
+{
+    if (!head || !to_queue(head)->size)
+        return false;
+
+    /* Kept elements are packed towards the head. Each element is only
+     * decided upon once the next one is known, so prev lags one behind.
+     */
+    queue_t *q = to_queue(head);
+    struct cursor out = {chunk_of(q->chunks.next), 0};
+    out.i = out.c->begin;
+    element_t *prev = NULL;
+    bool dup = false;
+    struct chunk *c;
+    list_for_each_entry(c, &q->chunks, list) {
+        for (unsigned int i = c->begin; i < c->end; i++) {
+            element_t *node = c->slots[i];
+            if (prev && !element_cmp(prev, node)) {
+                q_release_element(prev);
+                q->size--;
+                dup = true;
+            } else if (prev && dup) {
+                q_release_element(prev);
+                q->size--;
+                dup = false;
+            } else if (prev) {
+                out.c->slots[out.i] = prev;
+                cursor_advance(q, &out, 1);
+            }
+            prev = node;
+        }
+    }
+    if (dup) {
+        q_release_element(prev);
+        q->size--;
+    } else {
+        out.c->slots[out.i] = prev;
+        cursor_advance(q, &out, 1);
+    }
+
+    chunks_cut_after(q, out);
+    return true;
+}
+
+/* Swap every two adjacent nodes */
+void q_swap(struct list_head *head)
+{
+    if (!head)
+        return;
+
+    queue_t *q = to_queue(head);
+    element_t **prev = NULL;
+    struct chunk *c;
+    list_for_each_entry(c, &q->chunks, list) {
+        for (unsigned int i = c->begin; i < c->end; i++) {
+            if (!prev) {
+                prev = &c->slots[i];
+                continue;
+            }
+            element_t *tmp = *prev;
+            *prev = c->slots[i];
+            c->slots[i] = tmp;
+            prev = NULL;
+        }
+    }
+}
+
+/* Reverse elements in queue */
+void q_reverse(struct list_head *head)
+{
+    if (!head || to_queue(head)->size < 2)
+        return;
+
+    /* Reverse the order of the chunks, then the slots of every chunk */
+    queue_t *q = to_queue(head);
+    struct list_head *node = &q->chunks;
+    do {
+        struct list_head *next = node->next;
+        node->next = node->prev;
+        node->prev = next;
+        node = next;
+    } while (node != &q->chunks);
+
+    struct chunk *c;
+    list_for_each_entry(c, &q->chunks, list) {
+        for (unsigned int i = c->begin, j = c->end - 1; i < j; i++, j--) {
+            element_t *tmp = c->slots[i];
+            c->slots[i] = c->slots[j];
+            c->slots[j] = tmp;
+        }
+    }
+}
+
+/* Reverse the nodes of the list k at a time */
+void q_reverseK(struct list_head *head, int k)
+{
+    if (!head || q_size(head) < 2 || k <= 1 || k > q_size(head))
+        return;
+
+    queue_t *q = to_queue(head);
+    size_t times = q->size / k;
+    struct cursor start = {chunk_of(q->chunks.next), 0};
+    start.i = start.c->begin;
+
+    for (size_t n = 0; n < times; n++) {
+        struct cursor a = start, b = start;
+
+        cursor_advance(q, &b, k - 1);
+        start = b;
+        cursor_advance(q, &start, 1);
+        for (int j = 0; j < k / 2; j++) {
+            element_t *tmp = a.c->slots[a.i];
+            a.c->slots[a.i] = b.c->slots[b.i];
+            b.c->slots[b.i] = tmp;
+            cursor_advance(q, &a, 1);
+            cursor_prev(&b);
+        }
+    }
+}
+
+/* Thread the elements through their list nodes, which are otherwise unused,
+ * sort them as a list and store them back in order.
+ */
+static void chunks_sort(queue_t *q, bool descend)
+{
+    LIST_HEAD(list);
+    struct chunk *c;
+    list_for_each_entry(c, &q->chunks, list) {
+        for (unsigned int i = c->begin; i < c->end; i++)
+            list_add_tail(&c->slots[i]->list, &list);
+    }
+
+    list_sort(&list, descend, q->size);
+
+    struct list_head *node = list.next;
+    list_for_each_entry(c, &q->chunks, list) {
+        for (unsigned int i = c->begin; i < c->end; i++) {
+            c->slots[i] = list_entry(node, element_t, list);
+            node = node->next;
+        }
+    }
+}
+
+/* Sort elements of queue in ascending/descending order */
+void q_sort(struct list_head *head, bool descend)
+{
+    if (!head || to_queue(head)->size < 2)
+        return;
+
+    chunks_sort(to_queue(head), descend);
+}
+
+/* Keep the elements no element to their right sorts strictly before, in the
+ * requested order, and release the others.
+ */
+static int chunks_monotonic(struct list_head *head, bool descend)
+{
+    if (!head || !to_queue(head)->size)
+        return 0;
+
+    /* Kept elements are packed towards the tail, the leftmost at out */
+    queue_t *q = to_queue(head);
+    struct chunk *last = chunk_of(q->chunks.prev);
+    struct cursor out = {last, last->end - 1};
+    element_t *right = last->slots[out.i];
+    for (struct list_head *node = &last->list; node != &q->chunks;
+         node = node->prev) {
+        struct chunk *c = chunk_of(node);
+        unsigned int i = c == last ? c->end - 1 : c->end;
+        while (i-- > c->begin) {
+            element_t *entry = c->slots[i];
+            int r = element_cmp(entry, right);
+            if (descend ? r >= 0 : r <= 0) {
+                cursor_prev(&out);
+                out.c->slots[out.i] = entry;
+                right = entry;
+            } else {
+                q_release_element(entry);
+                q->size--;
+            }
+        }
+    }
+
+    chunks_cut_before(q, out);
+    return q->size;
+}
+
+/* Remove every node which has a node with a strictly less value anywhere to
+ * the right side of it */
+int q_ascend(struct list_head *head)
+{
+    return chunks_monotonic(head, false);
+}
+
+/* Remove every node which has a node with a strictly greater value anywhere to
+ * the right side of it */
+int q_descend(struct list_head *head)
+{
+    return chunks_monotonic(head, true);
+}
+
+/* Move the chunks of every queue to the first one in chain order, then sort
+ * it. The sort picks up each queue as a run of its own and merges them like
+ * a k-way merge would, in O(n log k) and keeping equal elements in chain
+ * order. Nothing is allocated.
+ */
+int q_merge(struct list_head *head, bool descend)
+{
+    if (!head || list_empty(head) || list_is_singular(head))
+        return q_size(list_entry(head->next, queue_contex_t, chain)->q);
+
+    queue_contex_t *first = list_entry(head->next, queue_contex_t, chain);
+    queue_t *first_q = to_queue(first->q);
+
+    struct list_head *pos;
+    list_for_each(pos, head) {
+        if (pos == head->next)
+            continue;
+
+        queue_contex_t *ctx = list_entry(pos, queue_contex_t, chain);
+        queue_t *q = to_queue(ctx->q);
+
+        /* Elements and chunks moving to the first queue take their slabs
+         * along.
+         */
+        pool_adopt(&first_q->pool, &q->pool);
+        list_splice_tail_init(&q->chunks, &first_q->chunks);
+        list_splice_tail_init(&q->spare, &first_q->spare);
+        first_q->size += q->size;
+        q->size = 0;
+        ctx->size = 0;
+    }
+
+    if (first_q->size > 1)
+        chunks_sort(first_q, descend);
+    first->size = first_q->size;
+    return first->size;
+}
+
+/* Fisher-Yates shuffle Algorithm, run over an index of the elements */
+void q_shuffle(struct list_head *head)
+{
+    if (!head || to_queue(head)->size < 2)
+        return;
+
+    queue_t *q = to_queue(head);
+    element_t **index = malloc(q->size * sizeof(*index));
+    if (!index)
+        return;
+
+    struct chunk *c;
+    size_t n = 0;
+    list_for_each_entry(c, &q->chunks, list) {
+        memcpy(index + n, &c->slots[c->begin],
+               (c->end - c->begin) * sizeof(*index));
+        n += c->end - c->begin;
+    }
+
+    /* Seeded from rand(), so that srand() still decides the outcome */
+    uint64_t state = (uint64_t) rand() << 32 ^ (uint64_t) rand();
+    for (size_t i = n - 1; i > 0; i--) {
+        size_t j = random_bounded(&state, i + 1);
+        element_t *tmp = index[i];
+        index[i] = index[j];
+        index[j] = tmp;
+    }
+
+    n = 0;
+    list_for_each_entry(c, &q->chunks, list) {
+        memcpy(&c->slots[c->begin], index + n,
+               (c->end - c->begin) * sizeof(*index));
+        n += c->end - c->begin;
+    }
+    free(index);
+}
@@ -28,6 +28,10 @@
 #define _GNU_SOURCE
 #endif
 
+#include <pthread.h>
+#include <stdbool.h>
+#include <string.h>
+
 #include "random.h"
 
 #if defined(__linux__) || defined(__GNU__)
@@ -272,7 +276,8 @@ static int bsd_randombytes(void *buf, size_t n)
 }
 #endif
 
-int randombytes(uint8_t *buf, size_t n)
+/* Fill buf with n bytes from the operating system */
+static int os_randombytes(uint8_t *buf, size_t n)
 {
 #if defined(__linux__) || defined(__GNU__)
 #if defined(USE_GLIBC)
@@ -291,3 +296,162 @@ int randombytes(uint8_t *buf, size_t n)
 #error "randombytes(...) is not supported on this platform"
 #endif
 }
+
+/* Random bytes are taken from a ChaCha20 keystream, see D. J. Bernstein,
+ * "ChaCha, a variant of Salsa20", 2008, generated a buffer at a time. Every
+ * buffer starts with the key of the next one, which is then erased, so that
+ * the bytes handed out cannot be told from the state of the generator, see
+ * D. J. Bernstein, "Fast-key-erasure random-number generators", 2017.
+ *
+ * Every thread runs a generator of its own, keyed from the operating system
+ * the first time it is used, again once it handed out RNG_RESEED bytes, and
+ * in a forked child, which must not repeat the bytes of its parent.
+ */
+
+#define CHACHA_BLOCKS 16
+#define RNG_BUFSIZE (64 * CHACHA_BLOCKS)
+#define RNG_KEYSIZE 32
+#define RNG_RESEED (1 << 20)
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    do {                         \
+        a += b;                  \
+        d = ROTL32(d ^ a, 16);   \
+        c += d;                  \
+        b = ROTL32(b ^ c, 12);   \
+        a += b;                  \
+        d = ROTL32(d ^ a, 8);    \
+        c += d;                  \
+        b = ROTL32(b ^ c, 7);    \
+    } while (0)
+
+/**
+ * struct rng - State of the generator of a thread
+ * @input: ChaCha20 constants, key, block counter and nonce
+ * @buf: keystream, of which the last @have bytes are still to be handed out
+ * @have: number of bytes left in @buf
+ * @produced: number of bytes handed out since the last seeding
+ * @generation: value of fork_generation at the last seeding
+ * @seeded: whether the generator was ever seeded
+ */
+struct rng {
+    uint32_t input[16];
+    uint8_t buf[RNG_BUFSIZE];
+    size_t have;
+    size_t produced;
+    unsigned generation;
+    bool seeded;
+};
+
+static __thread struct rng rng;
+
+/* Number of times the process forked */
+static unsigned fork_generation;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void rng_forked(void)
+{
+    fork_generation++;
+}
+
+static void rng_atfork(void)
+{
+    pthread_atfork(NULL, NULL, rng_forked);
+}
+
+static void chacha20_block(const uint32_t input[16], uint8_t out[64])
+{
+    uint32_t x[16];
+    memcpy(x, input, sizeof(x));
+    for (int i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (int i = 0; i < 16; i++) {
+        uint32_t v = x[i] + input[i];
+        out[4 * i] = v;
+        out[4 * i + 1] = v >> 8;
+        out[4 * i + 2] = v >> 16;
+        out[4 * i + 3] = v >> 24;
+    }
+}
+
+/* Key the keystream, from its start */
+static void rng_key(const uint8_t key[RNG_KEYSIZE])
+{
+    /* "expand 32-byte k" */
+    rng.input[0] = 0x61707865;
+    rng.input[1] = 0x3320646e;
+    rng.input[2] = 0x79622d32;
+    rng.input[3] = 0x6b206574;
+    for (int i = 0; i < 8; i++) {
+        rng.input[4 + i] = (uint32_t) key[4 * i] |
+                           (uint32_t) key[4 * i + 1] << 8 |
+                           (uint32_t) key[4 * i + 2] << 16 |
+                           (uint32_t) key[4 * i + 3] << 24;
+    }
+    for (int i = 12; i < 16; i++)
+        rng.input[i] = 0;
+}
+
+static void rng_refill(void)
+{
+    for (int i = 0; i < CHACHA_BLOCKS; i++) {
+        chacha20_block(rng.input, rng.buf + 64 * i);
+        if (!++rng.input[12])
+            rng.input[13]++;
+    }
+    rng_key(rng.buf);
+    memset(rng.buf, 0, RNG_KEYSIZE);
+    rng.have = RNG_BUFSIZE - RNG_KEYSIZE;
+}
+
+static int rng_seed(void)
+{
+    pthread_once(&atfork_once, rng_atfork);
+
+    uint8_t key[RNG_KEYSIZE];
+    if (os_randombytes(key, sizeof(key)) != 0)
+        return -1;
+    rng_key(key);
+    memset(key, 0, sizeof(key));
+
+    /* Nothing left over from before may be handed out */
+    memset(rng.buf, 0, sizeof(rng.buf));
+    rng.have = 0;
+    rng.produced = 0;
+    rng.generation = fork_generation;
+    rng.seeded = true;
+    return 0;
+}
+
+int randombytes(uint8_t *buf, size_t n)
+{
+    if (!rng.seeded || rng.generation != fork_generation ||
+        rng.produced >= RNG_RESEED) {
+        if (rng_seed() != 0)
+            return -1;
+    }
+    rng.produced += n;
+
+    while (n > 0) {
+        if (!rng.have)
+            rng_refill();
+        size_t chunk = n < rng.have ? n : rng.have;
+        uint8_t *p = rng.buf + RNG_BUFSIZE - rng.have;
+        memcpy(buf, p, chunk);
+        memset(p, 0, chunk);
+        rng.have -= chunk;
+        buf += chunk;
+        n -= chunk;
+    }
+    return 0;
+}
@@ -4,6 +4,10 @@
 #include <stddef.h>
 #include <stdint.h>
 
+/* Fill buf with len cryptographically secure random bytes, from a keystream
+ * buffered per thread, which only enters the kernel to be seeded.
+ * Return 0 on success, -1 if the operating system provided no seed.
+ */
 extern int randombytes(uint8_t *buf, size_t len);
 
 static inline uint8_t randombit(void)
@@ -48,4 +52,30 @@ static inline uintptr_t random_shuffle(uintptr_t x)
     return x;
 }
 
+/* Advance a splitmix64 generator by Sebastiano Vigna, see:
+ * <http://xoshiro.di.unimi.it/splitmix64.c>
+ */
+static inline uint64_t random_next(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* Uniformly distributed number in [0, range) drawn from the generator, by
+ * Daniel Lemire, see: <https://arxiv.org/abs/1805.10941>
+ */
+static inline uint32_t random_bounded(uint64_t *state, uint32_t range)
+{
+    uint64_t m = (random_next(state) >> 32) * range;
+
+    if ((uint32_t) m < range) {
+        uint32_t threshold = -range % range;
+        while ((uint32_t) m < threshold)
+            m = (random_next(state) >> 32) * range;
+    }
+    return m >> 32;
+}
+
 #endif
@@ -0,0 +1,113 @@
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Rings are shared between threads, so use regular malloc/free */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "lfqueue.h"
+#include "spsc.h"
+
+/**
+ * struct spsc - Ring of strings
+ * @head: index of the next slot to pop, only written by the consumer
+ * @tail_cache: the consumer's last reading of @tail
+ * @tail: index of the next slot to push, only written by the producer
+ * @head_cache: the producer's last reading of @head
+ * @mask: number of slots minus one, the number of slots being a power of 2
+ * @slots: the strings, at their index modulo the number of slots
+ *
+ * Indices only ever grow and wrap around at SIZE_MAX, so that the ring holds
+ * tail - head strings. Each side gets a cache line of its own, and only reads
+ * the index of the other side again once its cached reading runs out.
+ */
+struct spsc {
+    _Atomic size_t head __attribute__((aligned(64)));
+    size_t tail_cache;
+    _Atomic size_t tail __attribute__((aligned(64)));
+    size_t head_cache;
+    size_t mask __attribute__((aligned(64)));
+    char *slots[];
+};
+
+spsc_t *spsc_new(size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    spsc_t *r;
+    if (posix_memalign((void **) &r, 64, sizeof(*r) + size * sizeof(char *)))
+        return NULL;
+    atomic_init(&r->head, 0);
+    atomic_init(&r->tail, 0);
+    r->tail_cache = 0;
+    r->head_cache = 0;
+    r->mask = size - 1;
+    return r;
+}
+
+void spsc_free(spsc_t *r)
+{
+    free(r);
+}
+
+size_t spsc_push(spsc_t *r, char *const *items, size_t n)
+{
+    size_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    size_t room = r->mask + 1 - (tail - r->head_cache);
+    if (room < n) {
+        r->head_cache = atomic_load_explicit(&r->head, memory_order_acquire);
+        room = r->mask + 1 - (tail - r->head_cache);
+        if (n > room)
+            n = room;
+    }
+
+    for (size_t i = 0; i < n; i++)
+        r->slots[(tail + i) & r->mask] = items[i];
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    return n;
+}
+
+/* Return the number of strings the consumer may take, up to n */
+static size_t spsc_available(spsc_t *r, size_t head, size_t n)
+{
+    size_t avail = r->tail_cache - head;
+    if (avail < n) {
+        r->tail_cache = atomic_load_explicit(&r->tail, memory_order_acquire);
+        avail = r->tail_cache - head;
+    }
+    return avail < n ? avail : n;
+}
+
+size_t spsc_pop(spsc_t *r, char **items, size_t n)
+{
+    size_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    n = spsc_available(r, head, n);
+
+    for (size_t i = 0; i < n; i++)
+        items[i] = r->slots[(head + i) & r->mask];
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    return n;
+}
+
+size_t spsc_drain(spsc_t *r, struct list_head *head)
+{
+    size_t first = atomic_load_explicit(&r->head, memory_order_relaxed);
+    size_t n = spsc_available(r, first, SIZE_MAX);
+
+    LIST_HEAD(batch);
+    size_t i;
+    for (i = 0; i < n; i++) {
+        element_t *e = lfq_element_new(r->slots[(first + i) & r->mask]);
+        if (!e)
+            break;
+        list_add_tail(&e->list, &batch);
+    }
+
+    /* The slots are only handed back once the strings have been copied */
+    atomic_store_explicit(&r->head, first + i, memory_order_release);
+    list_splice_tail(&batch, head);
+    return i;
+}
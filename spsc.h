@@ -0,0 +1,48 @@
+#ifndef LAB0_SPSC_H
+#define LAB0_SPSC_H
+
+/* Bounded wait-free single-producer/single-consumer ring of strings.
+ *
+ * One thread pushes string pointers and another one pops them, in batches.
+ * Neither side ever waits for the other: a full ring takes fewer items than
+ * offered, an empty one hands out fewer than asked for. The strings are not
+ * copied, they must stay valid until popped or drained.
+ */
+
+#include <stddef.h>
+
+#include "list.h"
+
+typedef struct spsc spsc_t;
+
+/* Create an empty ring holding at least capacity strings.
+ * Return NULL if allocation failed.
+ */
+spsc_t *spsc_new(size_t capacity);
+
+/* Free the ring, but not the strings still in it */
+void spsc_free(spsc_t *r);
+
+/* Append up to n strings of items to the ring. Only called by the producer.
+ * Return the number of strings appended, less than n if the ring got full.
+ */
+size_t spsc_push(spsc_t *r, char *const *items, size_t n);
+
+/* Move up to n strings from the ring to items. Only called by the consumer.
+ * Return the number of strings moved, less than n if the ring got empty.
+ */
+size_t spsc_pop(spsc_t *r, char **items, size_t n);
+
+/* Copy every string in the ring into an element, allocated with
+ * lfq_element_new(), and append the elements to the list head in one
+ * list_splice_tail(). Only called by the consumer.
+ * The head must be a bare list head, as declared with LIST_HEAD(), and never
+ * a queue from q_new(): the length and the pool of such a queue would not
+ * account for the elements, which are to be freed with lfq_element_free()
+ * rather than q_release_element().
+ * Return the number of elements appended. Strings which could not be copied
+ * for lack of memory stay in the ring.
+ */
+size_t spsc_drain(spsc_t *r, struct list_head *head);
+
+#endif /* LAB0_SPSC_H */
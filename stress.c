@@ -0,0 +1,239 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+/* Worker threads run outside of the test harness */
+#define INTERNAL 1
+#include "harness.h"
+
+#include "cqueue.h"
+#include "lfqueue.h"
+#include "report.h"
+#include "stress.h"
+
+/* Exactly one of q and cq is used */
+struct stress_ctx {
+    lfqueue_t *q;
+    cqueue_t *cq;
+    int producers;
+    int ops;
+    long total;
+    atomic_long removed;
+    atomic_bool failed;
+};
+
+/**
+ * struct stress_worker - State of a producer or consumer thread
+ * @ctx: the run the thread takes part in
+ * @id: index of the thread among producers or consumers
+ * @lat: latency of every operation completed, in nanoseconds
+ * @nlat: number of entries in @lat
+ * @last: for consumers, sequence number of the last element seen from each
+ *        producer
+ */
+struct stress_worker {
+    struct stress_ctx *ctx;
+    int id;
+    uint64_t *lat;
+    size_t nlat;
+    long *last;
+    pthread_t tid;
+};
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *stress_produce(void *arg)
+{
+    struct stress_worker *w = arg;
+    struct stress_ctx *ctx = w->ctx;
+    int slot = ctx->q ? lfq_register(ctx->q) : -1;
+
+    for (int i = 0; i < ctx->ops && !atomic_load(&ctx->failed); i++) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "%d %d", w->id, i);
+
+        bool ok;
+        uint64_t start;
+        if (ctx->q) {
+            element_t *e = lfq_element_new(buf);
+            start = now_ns();
+            ok = e && lfq_insert_tail(ctx->q, slot, e);
+            if (!ok)
+                lfq_element_free(e);
+        } else {
+            start = now_ns();
+            ok = cq_insert_tail(ctx->cq, buf);
+        }
+        w->lat[w->nlat++] = now_ns() - start;
+        if (!ok)
+            atomic_store(&ctx->failed, true);
+    }
+    if (ctx->q)
+        lfq_unregister(ctx->q, slot);
+    return NULL;
+}
+
+/* Elements from a given producer must come out in the order they went in */
+static void *stress_consume(void *arg)
+{
+    struct stress_worker *w = arg;
+    struct stress_ctx *ctx = w->ctx;
+    int slot = ctx->q ? lfq_register(ctx->q) : -1;
+
+    while (atomic_load(&ctx->removed) < ctx->total &&
+           !atomic_load(&ctx->failed)) {
+        char buf[32];
+        bool ok;
+        uint64_t start = now_ns();
+        if (ctx->q) {
+            element_t *e = lfq_remove_head(ctx->q, slot);
+            w->lat[w->nlat] = now_ns() - start;
+            ok = e;
+            if (e) {
+                snprintf(buf, sizeof(buf), "%s", e->value);
+                lfq_element_free(e);
+            }
+        } else {
+            ok = cq_remove_head(ctx->cq, buf, sizeof(buf));
+            w->lat[w->nlat] = now_ns() - start;
+        }
+        if (!ok) {
+            sched_yield();
+            continue;
+        }
+        w->nlat++;
+
+        char *end;
+        long producer = strtol(buf, &end, 10);
+        long seq = strtol(end, NULL, 10);
+        if (producer < 0 || producer >= ctx->producers ||
+            seq <= w->last[producer])
+            atomic_store(&ctx->failed, true);
+        else
+            w->last[producer] = seq;
+        atomic_fetch_add(&ctx->removed, 1);
+    }
+    if (ctx->q)
+        lfq_unregister(ctx->q, slot);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Report latency percentiles of the operations of a group of workers */
+static void stress_report(const char *name, struct stress_worker *w, int n)
+{
+    size_t total = 0;
+    for (int i = 0; i < n; i++)
+        total += w[i].nlat;
+    if (!total)
+        return;
+
+    uint64_t *lat = malloc(total * sizeof(*lat));
+    if (!lat)
+        return;
+    size_t k = 0;
+    for (int i = 0; i < n; i++) {
+        for (size_t j = 0; j < w[i].nlat; j++)
+            lat[k++] = w[i].lat[j];
+    }
+    qsort(lat, total, sizeof(*lat), cmp_u64);
+
+    report(1,
+           "%s latency (ns): p50 %llu, p90 %llu, p99 %llu, p99.9 %llu, "
+           "max %llu",
+           name, (unsigned long long) lat[total / 2],
+           (unsigned long long) lat[total * 9 / 10],
+           (unsigned long long) lat[total * 99 / 100],
+           (unsigned long long) lat[total * 999 / 1000],
+           (unsigned long long) lat[total - 1]);
+    free(lat);
+}
+
+bool stress_run(int producers, int consumers, int ops, bool two_lock)
+{
+    struct stress_ctx ctx = {
+        .q = two_lock ? NULL : lfq_new(),
+        .cq = two_lock ? cq_new() : NULL,
+        .producers = producers,
+        .ops = ops,
+        .total = (long) producers * ops,
+    };
+    atomic_init(&ctx.removed, 0);
+    atomic_init(&ctx.failed, false);
+
+    int n = producers + consumers;
+    struct stress_worker *workers = calloc(n, sizeof(*workers));
+    bool ok = (ctx.q || ctx.cq) && workers;
+    for (int i = 0; ok && i < n; i++) {
+        struct stress_worker *w = &workers[i];
+        w->ctx = &ctx;
+        w->id = i < producers ? i : i - producers;
+        w->lat = malloc((i < producers ? ops : ctx.total) * sizeof(*w->lat));
+        if (i >= producers) {
+            w->last = malloc(producers * sizeof(*w->last));
+            for (int p = 0; w->last && p < producers; p++)
+                w->last[p] = -1;
+        }
+        ok = w->lat && (i < producers || w->last);
+    }
+    if (!ok) {
+        report(1, "ERROR: Could not allocate the state of the stress test");
+        goto out;
+    }
+
+    uint64_t start = now_ns();
+    int started = 0;
+    for (; started < n; started++) {
+        struct stress_worker *w = &workers[started];
+        if (pthread_create(&w->tid, NULL,
+                           started < producers ? stress_produce
+                                               : stress_consume,
+                           w)) {
+            atomic_store(&ctx.failed, true);
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(workers[i].tid, NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    if (atomic_load(&ctx.failed) || atomic_load(&ctx.removed) != ctx.total) {
+        report(1, "ERROR: Elements were lost or reordered, or a thread failed");
+        ok = false;
+        goto out;
+    }
+
+    report(1, "%s queue: %d producers, %d consumers, %ld elements in %.3f "
+           "seconds",
+           two_lock ? "Two-lock" : "Lock-free", producers, consumers,
+           ctx.total, elapsed);
+    report(1, "Throughput: %.0f ops/sec", 2 * ctx.total / elapsed);
+    stress_report("Insert", workers, producers);
+    stress_report("Remove", workers + producers, consumers);
+
+out:
+    if (workers) {
+        for (int i = 0; i < n; i++) {
+            free(workers[i].lat);
+            free(workers[i].last);
+        }
+        free(workers);
+    }
+    lfq_free(ctx.q);
+    cq_free(ctx.cq);
+    return ok;
+}
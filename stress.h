@@ -0,0 +1,14 @@
+#ifndef LAB0_STRESS_H
+#define LAB0_STRESS_H
+
+#include <stdbool.h>
+
+/* Have producers threads insert ops elements each into a queue, while
+ * consumers threads remove them, and report the throughput along with latency
+ * percentiles of both operations. The queue is an lfqueue_t, or a cqueue_t if
+ * two_lock is set, whose memory then comes from the test harness.
+ * Return false if the run failed or elements were lost or reordered.
+ */
+bool stress_run(int producers, int consumers, int ops, bool two_lock);
+
+#endif /* LAB0_STRESS_H */
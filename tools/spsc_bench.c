@@ -0,0 +1,235 @@
+/* Benchmark of the SPSC ring against a mutex-protected queue.
+ *
+ * A producer thread hands strings over to a consumer thread, either through
+ * an spsc_t in batches, drained into a list of elements, or one at a time
+ * through q_insert_tail() and q_remove_head() on a queue guarded by a mutex.
+ * Throughput is the rate strings reach the consumer at. Latency is half the
+ * round trip of a single string bounced back and forth between both threads.
+ *
+ * Usage: spsc_bench [messages] [batch]
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lfqueue.h"
+#include "queue.h"
+#include "spsc.h"
+
+#define RING_SIZE 4096
+#define MAX_BATCH 1024
+#define ROUND_TRIPS 20000
+
+static char *strings[MAX_BATCH];
+static long messages = 1000000;
+static size_t batch = 64;
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Run the consumer on CPU 1 and the producer on CPU 0 when there are two */
+static void pin(int cpu)
+{
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+/* Both ends of either kind of channel */
+struct channel {
+    spsc_t *ring;
+    struct list_head *q;
+    pthread_mutex_t lock;
+};
+
+static bool channel_init(struct channel *c, bool ring)
+{
+    c->ring = ring ? spsc_new(RING_SIZE) : NULL;
+    c->q = ring ? NULL : q_new();
+    pthread_mutex_init(&c->lock, NULL);
+    return c->ring || c->q;
+}
+
+static void channel_destroy(struct channel *c)
+{
+    spsc_free(c->ring);
+    q_free(c->q);
+    pthread_mutex_destroy(&c->lock);
+}
+
+/* Send n strings, waiting for room in the ring as needed */
+static void channel_send(struct channel *c, char **items, size_t n)
+{
+    if (c->ring) {
+        while (n) {
+            size_t sent = spsc_push(c->ring, items, n);
+            if (!sent)
+                sched_yield();
+            items += sent;
+            n -= sent;
+        }
+        return;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        pthread_mutex_lock(&c->lock);
+        q_insert_tail(c->q, items[i]);
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
+/* Receive whatever has been sent so far, at least one string.
+ * Return the number of strings received.
+ */
+static size_t channel_receive(struct channel *c)
+{
+    for (;;) {
+        size_t n = 0;
+        if (c->ring) {
+            LIST_HEAD(received);
+            n = spsc_drain(c->ring, &received);
+
+            element_t *e, *safe;
+            list_for_each_entry_safe(e, safe, &received, list)
+                lfq_element_free(e);
+        } else {
+            pthread_mutex_lock(&c->lock);
+            element_t *e = q_remove_head(c->q, NULL, 0);
+            if (e) {
+                q_release_element(e);
+                n = 1;
+            }
+            pthread_mutex_unlock(&c->lock);
+        }
+        if (n)
+            return n;
+        sched_yield();
+    }
+}
+
+struct run {
+    struct channel to, from;
+    uint64_t *rtt;
+};
+
+static void *produce(void *arg)
+{
+    struct channel *c = arg;
+    pin(0);
+    for (long sent = 0; sent < messages; sent += batch) {
+        size_t n = messages - sent < (long) batch ? messages - sent : batch;
+        channel_send(c, strings, n);
+    }
+    return NULL;
+}
+
+static void *consume(void *arg)
+{
+    struct channel *c = arg;
+    pin(1);
+    for (long received = 0; received < messages;)
+        received += channel_receive(c);
+    return NULL;
+}
+
+static void *echo(void *arg)
+{
+    struct run *run = arg;
+    pin(1);
+    for (int i = 0; i < ROUND_TRIPS; i++) {
+        channel_receive(&run->to);
+        channel_send(&run->from, strings, 1);
+    }
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return (x > y) - (x < y);
+}
+
+static bool bench(const char *name, bool ring)
+{
+    struct run run;
+    bool ok = channel_init(&run.to, ring) && channel_init(&run.from, ring);
+    run.rtt = malloc(ROUND_TRIPS * sizeof(*run.rtt));
+    if (!ok || !run.rtt) {
+        fprintf(stderr, "%s: out of memory\n", name);
+        return false;
+    }
+
+    pthread_t producer, consumer;
+    uint64_t start = now_ns();
+    pthread_create(&producer, NULL, produce, &run.to);
+    pthread_create(&consumer, NULL, consume, &run.to);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    pin(0);
+    pthread_create(&consumer, NULL, echo, &run);
+    for (int i = 0; i < ROUND_TRIPS; i++) {
+        uint64_t sent = now_ns();
+        channel_send(&run.to, strings, 1);
+        channel_receive(&run.from);
+        run.rtt[i] = now_ns() - sent;
+    }
+    pthread_join(consumer, NULL);
+    qsort(run.rtt, ROUND_TRIPS, sizeof(*run.rtt), cmp_u64);
+
+    printf("%-12s %12.0f msgs/sec   latency (ns): p50 %llu, p99 %llu\n", name,
+           messages / elapsed,
+           (unsigned long long) run.rtt[ROUND_TRIPS / 2] / 2,
+           (unsigned long long) run.rtt[ROUND_TRIPS * 99 / 100] / 2);
+
+    free(run.rtt);
+    channel_destroy(&run.to);
+    channel_destroy(&run.from);
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc > 1)
+        messages = atol(argv[1]);
+    if (argc > 2)
+        batch = atol(argv[2]);
+    if (messages < 1 || batch < 1 || batch > MAX_BATCH) {
+        fprintf(stderr, "Usage: %s [messages] [batch (1-%d)]\n", argv[0],
+                MAX_BATCH);
+        return 1;
+    }
+
+    for (int i = 0; i < MAX_BATCH; i++) {
+        strings[i] = malloc(16);
+        snprintf(strings[i], 16, "msg%d", i);
+    }
+
+    if (sysconf(_SC_NPROCESSORS_ONLN) < 2)
+        printf("Only one CPU online, threads share it\n");
+    printf("%ld messages, batches of %zu\n", messages, batch);
+    bool ok = bench("spsc", true) && bench("mutex queue", false);
+
+    for (int i = 0; i < MAX_BATCH; i++)
+        free(strings[i]);
+    return !ok;
+}
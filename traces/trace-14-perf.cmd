@@ -1,6 +1,7 @@
 # Test performance of 'q_new', 'q_insert_head', 'q_insert_tail', 'q_reverse', and 'q_sort'
 option fail 0
 option malloc 0
+option fast 1
 new
 ih dolphin 1000000
 it gerbil 1000000
@@ -1,7 +1,12 @@
 # Test if time complexity of 'q_insert_tail', 'q_insert_head', 'q_remove_tail', and 'q_remove_head' is constant
+# Queues of different sizes lie differently in memory, which shifts timings
+# by a few cycles either way, so that leaks up to tau 0.5 are let through.
+option dudect_leak 500
 option simulation 1
 it
 ih
 rh
 rt
+# The linear reverse shows tau above 1, and must be found not constant time
+reverse
 option simulation 0
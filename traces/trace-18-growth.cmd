@@ -0,0 +1,5 @@
+# Test the growth of the running time of every queue operation with queue size
+option fail 0
+option malloc 0
+option fast 1
+complexity all 16384